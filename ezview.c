@@ -1,11 +1,82 @@
 #define GLFW_DLL 1
 
+// For fopencookie, which compressed input is read through
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+// Files over 2 GB need 64-bit offsets in 32-bit builds
+#ifndef _WIN32
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// --watch is told of writes by inotify on Linux, and polls elsewhere
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
 #define GL_GLEXT_PROTOTYPES
 #include <GLES2/gl2.h>
 #include <GLFW/glfw3.h>
 
+// From GL_OES_compressed_ETC1_RGB8_texture, which not every gl2ext.h has
+#ifndef GL_ETC1_RGB8_OES
+#define GL_ETC1_RGB8_OES 0x8D64
+#endif
+
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+// Compressed input needs a stdio stream with custom reads, which Windows
+// lacks. zlib is used unless EZVIEW_NO_ZLIB is defined, zstd only when
+// EZVIEW_ZSTD is.
+#if !defined(_WIN32) && !defined(EZVIEW_NO_ZLIB)
+#define EZVIEW_ZLIB 1
+#include <zlib.h>
+#endif
+#if defined(_WIN32)
+#undef EZVIEW_ZSTD
+#elif defined(EZVIEW_ZSTD)
+#include <zstd.h>
+#endif
+
+// Frames from another process come through a POSIX shared-memory ring
+#ifndef _WIN32
+#include "shmring.h"
+#endif
+
+// SIMD kernels are used when the compiler targets SSE2 or AVX2. Define
+// EZVIEW_NO_SIMD to build the scalar versions only.
+#if !defined(EZVIEW_NO_SIMD) && defined(__AVX2__)
+#define EZVIEW_AVX2 1
+#include <immintrin.h>
+#elif !defined(EZVIEW_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+      (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define EZVIEW_SSE2 1
+#include <emmintrin.h>
+#endif
 
 GLFWwindow* window;
 
@@ -25,17 +96,729 @@ typedef struct {
   unsigned char red, green, blue;
 } Pixel;
 
+// Pixel arrays are uploaded as packed GL_RGB, so there must be no padding
+typedef char PixelIsPacked[sizeof(Pixel) == 3 ? 1 : -1];
+
 // Holds information about the header of a ppm file
 typedef struct Header {
    unsigned char magicNumber;
    unsigned int width, height, maxColor;
+   unsigned int channels;             // 1 for PBM and PGM, 3 for PPM
 } Header;
 
+// Size of the blocks read from the input when parsing P3 data
+#define P3_BLOCK_SIZE (1 << 20)
+
+// Maps a sample in 0..maxColor to 0..255 with rounding, given
+// scale = sampleScale(maxColor). Out of range samples are clamped.
+#define scaleSample(value, maxColor, scale) \
+  ((((value) < (maxColor) ? (value) : (maxColor)) * (scale) + 32768) >> 16)
+
+// Holds the state of the P3 sample scanner between blocks
+typedef struct P3Scanner {
+  unsigned char *out;     // Destination of the parsed samples
+  size_t count, max;      // Samples parsed so far and samples wanted
+  unsigned int value;     // Value of a token that may continue in the next block
+  int inToken, inComment;
+  unsigned int maxColor;  // Samples are scaled from 0..maxColor to 0..255
+  unsigned int scale;     // From sampleScale
+  int invalid;            // Set when a character that is not a sample is met
+} P3Scanner;
+
+// Holds a read-only memory mapping of an input file
+typedef struct MappedFile {
+  const unsigned char *data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE file, mapping;
+#endif
+} MappedFile;
+
+// Edge length of a texture tile, in pixels. Clamped to GL_MAX_TEXTURE_SIZE.
+#define TILE_SIZE 2048
+
+// Texels each tile of a tiled image repeats from its neighbors on every
+// side, as many as Lanczos-3 reads past a texel and one more than bicubic.
+// Textures stay TILE_SIZE across and cover that much less of the image.
+#define TILE_BORDER 3
+
+// Default limit on the texture memory used by resident tiles, in megabytes
+#define TILE_BUDGET_MB 512
+
+// An image whose tiles cannot all be resident gets a decimated overview,
+// which takes at most this fraction of the budget
+#define OVERVIEW_SHARE 4
+
+// Sampling done by the fragment shader, from --filter and cycled by L
+#define FILTER_NEAREST 0
+#define FILTER_BICUBIC 1                 // Catmull-Rom
+#define FILTER_LANCZOS 2                 // Lanczos-3
+#define FILTER_COUNT 3
+
+// Size of the texture of filter weights. Each row of WEIGHT_STEPS texels
+// holds weights for a fractional position from 0 to 1, and the fragment
+// shader has the same numbers.
+#define WEIGHT_STEPS 64
+#define WEIGHT_ROWS 3
+
+// Weights are stored in 8 bits as (w - WEIGHT_MIN) / WEIGHT_RANGE, which
+// covers the negative lobes and the sum of two taps
+#define WEIGHT_MIN -0.25
+#define WEIGHT_RANGE 1.5
+
+// Effort spent encoding tiles to ETC1, from --etc1
+#define ETC1_FAST 1
+#define ETC1_BEST 2
+
+// Block sizes of the ETC1 format, 4 by 4 pixels in 8 bytes
+#define ETC1_BLOCK 4
+#define ETC1_BLOCK_BYTES 8
+
+// Levels with fewer blocks than this are encoded on one thread
+#define ETC1_THREAD_BLOCKS 4096
+
+// A piece of the image drawn with its own texture and quad
+typedef struct Tile {
+  int x, y;                          // Corner of the texture in the image, in pixels
+  unsigned int width, height;        // Size of the texture, border included
+  float left, top, right, bottom;    // Edges of the quad in model space
+  GLuint texture;                    // 0 while the tile is not resident
+  unsigned int rowsUploaded;         // Rows of the tile in its texture so far
+  size_t bytes;                      // Texture memory used while resident
+  unsigned long lastUsed;            // Frame the tile was last visible in
+  unsigned char *levels;             // Mip levels below the base, kept by live tile sets
+  unsigned char *blocks;             // ETC1 blocks of every level, kept after eviction
+} Tile;
+
+// Counts kept as the tiles of a set are encoded to ETC1
+typedef struct EncodeStats {
+  unsigned int tiles;
+  unsigned int reported;             // Tiles encoded when writeEncodeStats last ran
+  unsigned long long pixels;         // Of every level
+  double seconds;
+  double error;                      // Squared error summed over the base levels
+  unsigned long long samples;        // Samples the error is summed over
+} EncodeStats;
+
+// Holds the tiles of an image and the state needed to stream them
+typedef struct TileSet {
+  unsigned int width, height;        // Size of the image
+  unsigned int tileSize, columns, rows;
+  unsigned int border;               // TILE_BORDER, or 0 for an image in one texture
+  Tile *tiles;
+  const unsigned char *pixels;       // Packed rows the tiles are uploaded from
+  unsigned int channels;             // 1 for luminance, 3 for RGB
+  unsigned int rowsReady;            // Rows at the top of pixels that are decoded
+  unsigned char *staging;            // Holds one tile's rows during upload
+  GLuint vertexBuffer;
+  int npotMipmaps;                   // Whether non-power-of-two tiles can have mip levels
+  size_t residentBytes, budget;
+  unsigned long frame;
+  unsigned int uploadLimit;          // Tiles uploaded per frame, 0 for no limit
+  unsigned int pending;              // Visible tiles not fully uploaded after a frame,
+                                     // besides those over the budget
+  int streaming;                     // Whether tiles are refilled every frame, without mips
+  int live;                          // Whether uploaded rows may change, see refreshRows
+  int compression;                   // ETC1_FAST or ETC1_BEST to upload tiles encoded, or 0
+  int threads;                       // Threads that encode a tile
+  size_t blockBytes;                 // Memory held by the ETC1 blocks of the tiles
+  EncodeStats encoded;
+} TileSet;
+
+// Minimal threads over Win32 and pthreads
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
+typedef volatile LONG Flag;
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+typedef atomic_int Flag;
+#endif
+
+// Entry point of a thread started with startThread
+typedef void (*ThreadFunc)(void *);
+
+// Tone and channel adjustments made when drawing, in the order listed. The
+// fragment shader gets them as uniforms, so changing one redraws at the
+// cost of a frame.
+typedef struct ColorAdjust {
+  float black, white;                // Levels stretched to 0 and 1
+  float gamma;                       // Samples are raised to 1 / gamma
+  float contrast;                    // Scale about middle gray
+  float brightness;                  // Added after contrast
+  int channel;                       // 1, 2 or 3 to show red, green or blue as gray, 0 for all
+  int invert;
+} ColorAdjust;
+
+// A program that draws tiles with one of the filters, and the locations of
+// its uniforms
+typedef struct Program {
+  GLuint id;
+  GLint mvp, levels, tone, channel;
+  GLint tileSize;                    // -1 in the nearest program, which needs none
+} Program;
+
+// Holds the settings for a software render of the view
+typedef struct RenderJob {
+  Pixel *out;
+  int width, height;                 // Size of the output
+  const unsigned char *pixels;       // Packed luminance or RGB source
+  unsigned int imageWidth, imageHeight, channels;
+  float inverse[2][3];               // Maps clip space x, y back to model space
+  int bilinear;
+  int firstRow, lastRow;             // Band of output rows for one thread
+  const unsigned char *colors;       // Each sample after the tone adjustments
+  int channel;                       // From ColorAdjust
+} RenderJob;
+
+// A band of block rows of one level that a thread encodes to ETC1
+typedef struct Etc1Job {
+  unsigned char *out;                // Blocks of the level, left to right, top to bottom
+  const unsigned char *pixels;       // Packed luminance or RGB rows of the level
+  unsigned int width, height, channels;
+  unsigned int firstRow, lastRow;    // Rows of blocks
+  int effort;                        // ETC1_FAST or ETC1_BEST
+  double error;                      // Squared error of the blocks encoded
+} Etc1Job;
+
+// A base color, modifier table and selectors for one half of an ETC1 block
+typedef struct Etc1Fit {
+  int base[3];                       // Quantized to 4 or 5 bits
+  int table;
+  unsigned int error;
+  unsigned char selectors[16];       // Of the pixels in the half, by index y * 4 + x
+} Etc1Fit;
+
+// Tracks how many rows at the top of an image have been decoded. Shared
+// between a loader thread and the render thread.
+typedef struct LoadProgress {
+  Mutex mutex;
+  unsigned int rowsReady;
+  int notify;                        // Whether to wake the render thread
+  int failed;                        // Set when decoding stops on bad data
+} LoadProgress;
+
+// Sidecar files that hold the decoded pixels of slow-to-parse inputs, so
+// they can be mapped on the next open
+#define DISK_CACHE_SUFFIX ".ezc"
+#define DISK_CACHE_MAGIC "EZVIEWC1"
+
+// Pixel data in a sidecar starts at a multiple of this, to be usable
+// straight from a mapping
+#define DISK_CACHE_ALIGN 4096
+
+// Inputs smaller than this are quick enough to decode again
+#define DISK_CACHE_MIN_BYTES (1 << 20)
+
+// Start of a sidecar file. Packed RGB rows follow at dataOffset.
+typedef struct DiskCacheHeader {
+  char magic[8];
+  unsigned int byteOrder;            // 0x01020304 as written
+  unsigned int magicNumber, width, height, maxColor;  // Header of the source
+  unsigned long long sourceSize;
+  long long sourceTime;              // Modification time of the source
+  unsigned long long dataOffset;
+} DiskCacheHeader;
+
+// A rectangle of an image, read keeping every step-th row and column
+typedef struct Region {
+  unsigned int x, y, width, height;
+  unsigned int step;
+} Region;
+
+// How openImage reads a file
+typedef struct LoadOptions {
+  int threads;                       // Threads for decoding P2 and P3 data
+  int diskCache;                     // Whether sidecar files are used
+  unsigned int preview;              // Decimation of a quick first read, 1 for none
+  Region crop;                       // Part of the image to load when cropped is set
+  int cropped;
+  size_t budget;                     // Texture budget an overview is sized for, 0 for none
+} LoadOptions;
+
+// Holds an image while it is decoded on a background thread
+typedef struct Loader {
+  Header header;
+  const unsigned char *pixels;       // Packed rows, in buffer or in map
+  unsigned char *buffer;
+  MappedFile map;
+  LoadProgress progress;
+  FILE *input;                       // Positioned at the pixel data
+  const char *path;
+  long long dataOffset;
+  int threads;
+  Thread thread;
+  int running;                       // Whether thread has to be joined
+  int diskCache;                     // Whether to write a sidecar once decoded
+  unsigned long long sourceSize;     // Stamp of the input when it was opened
+  long long sourceTime;
+  Header source;                     // Header of the file, before any crop
+  Region region;                     // Part of the file that header describes
+  int cropped;
+  unsigned char *preview;            // Decimated pixels, while the image loads
+  Header previewHeader;
+  unsigned int overview;             // Decimation of a preview kept for good, 0 for none
+  int compression;                   // Format input is decompressed from
+} Loader;
+
+// Formats of compressed input, told apart by their first bytes
+#define COMPRESSION_NONE 0
+#define COMPRESSION_GZIP 1
+#define COMPRESSION_ZSTD 2
+
+// Decompressed data is handed to the decoder in blocks of this size through
+// a ring of STREAM_BLOCKS of them. One is kept after it is read, since stdio
+// seeks back to the start of its buffer, and the rest are decompressed
+// ahead. Memory stays at the ring however large the file.
+#define STREAM_BLOCK_SIZE (1 << 20)
+#define STREAM_BLOCKS 4
+
+// Compressed bytes read from the file at a time
+#define STREAM_INPUT_SIZE (1 << 18)
+
+// Decompresses a file on its own thread into a ring of blocks, read by the
+// decoder through the FILE returned by openCompressed
+typedef struct Inflater {
+  FILE *source;                      // The compressed file
+  const char *path;
+  int compression;
+  unsigned char *input;              // Compressed bytes read from source
+  size_t inputStart, inputEnd;       // The part of input not used yet
+  unsigned char *blocks[STREAM_BLOCKS];
+  size_t lengths[STREAM_BLOCKS];
+  unsigned long long filled, drained;  // Blocks written and read so far
+  size_t offset;                     // Read position in the oldest block
+  unsigned long long position;       // Decompressed bytes read so far
+  int finished;                      // Whether every block has been written
+  int closing;                       // Set when the decoder stops reading
+  int ended;                         // Whether the last frame was complete
+  int failed;                        // Set when the data is corrupt or cut short
+  Mutex mutex;
+  Cond changed;                      // A block was written or read
+  Thread thread;
+  int running;
+#ifdef EZVIEW_ZLIB
+  z_stream zlib;
+#endif
+#ifdef EZVIEW_ZSTD
+  ZSTD_DStream *zstd;
+#endif
+} Inflater;
+
+// A piece of mapped P3 data decoded by one thread
+typedef struct P3Chunk {
+  const char *start, *end;
+  size_t tokens;                     // Samples in the chunk, from the first pass
+  int invalid;                       // Whether the first pass met bad data
+  size_t offset;                     // Index of the chunk's first sample
+  size_t wanted, parsed;             // Samples to store and stored so far
+  unsigned char *out;
+  size_t max;                        // Samples in the whole image
+  size_t rowSamples;                 // Samples in one row of the image
+  unsigned int maxColor;
+  struct P3Chunk *chunks;            // All chunks, for reporting progress
+  int count;
+  LoadProgress *progress;
+} P3Chunk;
+
+// Pixels counted by a thread between adding its 32-bit counts into the totals
+#define HISTOGRAM_BLOCK (1 << 24)
+
+// Size of the histogram drawn over the image, in pixels
+#define HISTOGRAM_PLOT_WIDTH 256
+#define HISTOGRAM_PLOT_HEIGHT 128
+
+// Distance of the histogram from the corner of the window, in pixels
+#define HISTOGRAM_MARGIN 10
+
+// Counts of each sample value in every channel of an image, and the
+// statistics they give
+typedef struct Histogram {
+  unsigned int channels;
+  unsigned long long bins[3][256];
+  unsigned int min[3], max[3];
+  double mean[3];
+} Histogram;
+
+// The part of an image one thread of computeHistogram counts
+typedef struct HistogramJob {
+  const unsigned char *samples;
+  size_t count;                      // Pixels
+  unsigned int channels;
+  unsigned long long bins[3][256];
+} HistogramJob;
+
+// Default limit on the memory used by browsed images, decoded and as
+// textures, in megabytes
+#define CACHE_BUDGET_MB 1024
+
+// Images decoded ahead on each side of the one shown
+#define PREFETCH_DISTANCE 1
+
+// Most images held by the browser at once
+#define CACHE_ENTRIES 16
+
+// An image held by the browser, decoding or decoded, with its textures once
+// it has been shown
+typedef struct CachedImage {
+  int index;                         // Position in the file list, -1 if unused
+  Loader loader;
+  TileSet tiles;
+  int hasTiles;                      // Whether tiles is set up, which needs the GL
+  TileSet previewTiles;              // Drawn under tiles until they are all in
+  int hasPreviewTiles;
+  Histogram histogram;               // Counted once the image is decoded
+  int hasHistogram;
+  TileSet histogramTiles;            // The histogram plotted, for the overlay
+  unsigned char *histogramPlot;
+  int hasHistogramTiles;
+  unsigned long lastUsed;
+  int passedOver;                    // Whether it failed and was skipped once
+} CachedImage;
+
+// Holds the files being browsed and the images decoded from them
+typedef struct ImageCache {
+  char **paths;
+  int count;
+  CachedImage entries[CACHE_ENTRIES];
+  size_t budget;
+  unsigned long clock;
+  LoadOptions options;
+} ImageCache;
+
+// Decoded frames --play keeps ahead of the one on screen
+#define PLAY_FRAMES 8
+
+// A slot in the ring of decoded frames
+typedef struct PlayFrame {
+  Loader loader;
+  long long position;                // Place in the sequence, counting loops
+  int ready;                         // Whether loader holds that frame, decoded
+  int skipped;                       // Whether it could not be used, with loader closed
+} PlayFrame;
+
+// Plays the files being browsed as a sequence at a fixed rate. Worker
+// threads decode frames into the ring, and each frame shown is uploaded
+// into the textures not being drawn from before they are swapped.
+typedef struct Player {
+  char **paths;
+  int count;
+  LoadOptions options;
+  Header header;                     // Every frame must match the first
+  double rate;                       // Frames per second
+  PlayFrame frames[PLAY_FRAMES];
+  long long decoded, released;       // Next position to decode, first still held
+  int stopping;
+  Mutex mutex;
+  Cond changed;                      // A frame was decoded or released
+  Thread workers[PLAY_FRAMES];
+  int workerCount;
+  TileSet tiles[2];                  // Front and back textures
+  int front;
+  long long shown;                   // Position on screen, -1 before the first
+  double started;                    // When position 0 was due
+  double pausedAt;                   // When the clock stopped, while paused
+  int paused;
+  unsigned long displayed, dropped;
+  unsigned long skipped;             // Frames passed over as unreadable or mismatched
+  unsigned char *bad;                // Per file, whether it was passed over
+  int badFiles;                      // in the first loop, which later loops skip
+} Player;
+
+// Shows the newest frame a producer process has put in a shared-memory
+// ring, uploading it straight from the shared pixels
+typedef struct SharedSource {
+  const char *name;
+  struct ShmRing *ring;              // Mapped read-only
+  size_t size;
+  unsigned long long published;      // Count published when the frame shown was
+  unsigned long long frame;          // Number of the frame on screen
+  Header header;                     // Size of the frames the tiles hold
+  TileSet tiles[2];                  // Front and back textures
+  int front;
+  int hasTiles;
+  int valid;                         // Whether the front tiles hold a frame
+  size_t budget;
+  unsigned long displayed, dropped;
+  unsigned long torn;                // Uploads redone after the producer lapped them
+} SharedSource;
+
+// How often --shm looks again for a ring the producer has not created yet
+#define SHM_WAIT_MS 100
+
+// How long the thread following a file for --watch waits between looks at
+// it, in milliseconds
+#define WATCH_INTERVAL_MS 250
+
+// Changed rows at most this far apart are uploaded as one band
+#define REFRESH_BAND_GAP 8
+
+// Follows the file shown for --watch on its own thread, woken by inotify
+// where there is one and polling its size and modification time otherwise.
+// Once it changes, the render thread decodes it again and uploads only the
+// rows that differ.
+typedef struct Watcher {
+  const char *path;                  // File shown
+  unsigned long long size;           // Stamp of the version shown or being decoded
+  long long time;
+  int retarget;                      // Set when path changes, for the thread
+  int changed;                       // Set by the thread when the stamp moves
+  int stopping;
+  Mutex mutex;
+  Thread thread;
+  int running;
+  int notify;                        // inotify descriptor, -1 when polling
+  int watch;                         // Watch on the directory of path, -1 for none
+  Loader next;                       // The new version while it decodes
+  int reloading;
+  double reloaded;                   // When the new version was opened
+  LoadOptions options;
+  size_t budget;
+} Watcher;
+
+// Keys replayed one per frame by --bench when no --replay file is given.
+// Rotates, pans, scales and shears, then undoes each so the view stays put.
+#define BENCH_SCRIPT "EEEEWWWWRRRRYYYY2222DDDDUUUUQQQQSSSSFFFFHHHH1111AAAAJJJJ"
+
+// --capture passes when no more than this share of pixels differ from the
+// CPU render by more than the tolerance in a channel. Nearest sampling may
+// pick the neighboring texel where a pixel center falls on a texel edge.
+#define CAPTURE_TOLERANCE 2
+#define CAPTURE_MAX_OUTLIERS 0.001
+
+// Timings gathered by --bench, in seconds
+typedef struct BenchReport {
+  const char *path;
+  Header header;
+  int windowWidth, windowHeight;
+  int threads;
+  const char *renderer;
+  double load;                       // Opening the file and reading the header
+  double decode;                     // Until every row is decoded
+  double upload;                     // First frame, which uploads the visible tiles
+  double histogram;                  // computeHistogram on the decoded image
+  double histogramNaive;             // The same counted one sample at a time
+  int histogramMatches;              // Whether both agree
+  int filter;                        // From --filter
+  int compression;                   // From --etc1
+  EncodeStats encoded;               // Of the tiles uploaded
+  double *frames;                    // Each later frame, finished with glFinish
+  int frameCount;
+  int tracing;                       // Whether --trace was on
+  unsigned long traceEvents;         // Events it recorded, to weigh its cost
+} BenchReport;
+
+// Most events kept by --trace. Later events are counted but dropped.
+#define TRACE_MAX_EVENTS (1 << 22)
+
+// A begin, end or counter event for chrome://tracing or Perfetto
+typedef struct TraceEvent {
+  const char *name;                  // Must be a string literal
+  char phase;                        // 'B' begin, 'E' end or 'C' counter
+  int thread;                        // Numbered from 1 in the order first seen
+  double time;                       // Seconds since tracing started
+  double value;                      // Value of a counter
+} TraceEvent;
+
+// Events recorded by --trace from every thread
+typedef struct Trace {
+  Mutex mutex;
+  TraceEvent *events;
+  size_t count, capacity, dropped;
+  int threadCount;                   // Threads that have recorded events
+  double origin;
+  int enabled;
+} Trace;
+
+// Storage local to each thread
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+// Scoped timers and counters for --trace. Every TRACE_BEGIN needs a
+// TRACE_END with the same name on the same thread. Define EZVIEW_NO_TRACE
+// to compile them out.
+#ifndef EZVIEW_NO_TRACE
+#define TRACE_BEGIN(name) do { if (trace.enabled) traceEvent(name, 'B', 0); } while (0)
+#define TRACE_END(name) do { if (trace.enabled) traceEvent(name, 'E', 0); } while (0)
+#define TRACE_COUNTER(name, value) \
+  do { if (trace.enabled) traceEvent(name, 'C', (double) (value)); } while (0)
+#else
+#define TRACE_BEGIN(name) ((void) 0)
+#define TRACE_END(name) ((void) 0)
+#define TRACE_COUNTER(name, value) ((void) 0)
+#endif
+
 // Function declarations
-Header parseHeader(FILE *);
-void readP3(Pixel *, Header, FILE *);
-void readP6(Pixel *, Header, FILE *);
-void skipComments(FILE *);
+int parseHeader(FILE *, Header *);
+int readP3(unsigned char *, Header, FILE *, LoadProgress *);
+int readP1(unsigned char *, Header, FILE *, LoadProgress *);
+int readP4(unsigned char *, Header, FILE *, LoadProgress *);
+void unpackBits(unsigned char *, const unsigned char *, size_t);
+void scanP3Block(P3Scanner *, const char *, const char *);
+void finishP3Scan(P3Scanner *);
+int readP3Parallel(unsigned char *, Header, const unsigned char *, size_t, int, LoadProgress *);
+void countP3Chunk(void *);
+void parseP3Chunk(void *);
+void reportP3Chunk(P3Chunk *, size_t);
+int readP6(unsigned char *, Header, FILE *, LoadProgress *);
+unsigned int sampleScale(unsigned int);
+void convertSamples(unsigned char *, const unsigned char *, size_t, unsigned int);
+void convertSamples16(unsigned char *, const unsigned char *, size_t, unsigned int);
+int openImage(Loader *, const char *, const LoadOptions *);
+int readPreview(Loader *, unsigned int);
+int readRegion(unsigned char *, Header, Region, const unsigned char *, FILE *, long long,
+                LoadProgress *);
+int shrinkImage(Loader *);
+unsigned int overviewStep(Header, size_t);
+void readOverview(Loader *);
+int sizeFits(unsigned int, unsigned int, unsigned int);
+Region clipRegion(Region, Header);
+const unsigned char *mapDiskCache(MappedFile *, const char *, Header *, unsigned long long, long long);
+void writeDiskCache(Loader *);
+char *diskCachePath(const char *, const char *);
+int fileStamp(const char *, unsigned long long *, long long *);
+int detectCompression(FILE *);
+FILE *openCompressed(FILE *, const char *, int);
+void inflateInput(void *);
+int produceBlock(Inflater *);
+int inflateBlock(Inflater *, unsigned char *, size_t *);
+long long readInflater(Inflater *, char *, size_t);
+int seekInflater(Inflater *, long long *, int);
+int closeInflater(Inflater *);
+void loadImage(void *);
+void waitForImage(Loader *);
+void closeImage(Loader *);
+void freePixels(Loader *);
+int abandonImage(Loader *);
+void reportRows(LoadProgress *, unsigned int);
+unsigned int readyRows(LoadProgress *);
+void failLoad(LoadProgress *);
+int loadFailed(LoadProgress *);
+const unsigned char *mapSamples(MappedFile *, const char *, Header, long long);
+int mapFile(MappedFile *, const char *);
+int seekFile(FILE *, long long);
+long long tellFile(FILE *);
+void unmapFile(MappedFile *);
+int skipComments(FILE *);
+void initTiles(TileSet *, unsigned int, unsigned int, unsigned int, const unsigned char *, size_t);
+void drawTiles(TileSet *, mat4x4);
+void bindTiles(TileSet *, GLint, GLint);
+int tileVisible(Tile *, mat4x4);
+void uploadTile(TileSet *, Tile *);
+const unsigned char *tileRows(TileSet *, Tile *, unsigned int, unsigned int);
+unsigned int readyTileRows(TileSet *, Tile *);
+int evictTiles(TileSet *, size_t);
+size_t tileBytes(unsigned int, unsigned int, unsigned int);
+size_t uploadBytes(TileSet *, Tile *);
+void viewMatrix(mat4x4, int, int);
+void replayKeys(const char *);
+void replayKey(int);
+char *readKeyFile(const char *);
+double nowSeconds(void);
+void writeBenchReport(FILE *, BenchReport *);
+int benchKernels(FILE *, const char *, const unsigned char *, Header, unsigned int, unsigned int,
+                 int);
+char *writeP3Text(const unsigned char *, size_t, unsigned int, size_t *);
+int naiveReadP3(unsigned char *, Header, FILE *);
+void naiveDownsample(unsigned char *, const unsigned char *, unsigned int, unsigned int, int);
+void naiveConvert16(unsigned char *, const unsigned char *, size_t, unsigned int);
+void writeJsonString(FILE *, const char *);
+int compareDoubles(const void *, const void *);
+void startTrace(void);
+void traceEvent(const char *, char, double);
+int writeTrace(const char *);
+int listImages(char ***, char **, int);
+int listDirectory(char ***, int *, int *, const char *);
+int appendPath(char ***, int *, int *, const char *, const char *);
+int isDirectory(const char *);
+int isImageName(const char *);
+int comparePaths(const void *, const void *);
+void initCache(ImageCache *, char **, int, size_t, const LoadOptions *);
+CachedImage *cacheImage(ImageCache *, int);
+void prefetchImages(ImageCache *, int);
+void evictImages(ImageCache *, int);
+size_t imageBytes(CachedImage *);
+void releaseImage(CachedImage *);
+void freeTiles(TileSet *);
+void startPlayer(Player *, char **, int, const LoadOptions *, Header, double, int, size_t);
+void decodeFrames(void *);
+int loadFrame(Player *, Loader *, const char *);
+TileSet *showFrame(Player *, double);
+void releaseFrame(Player *, long long);
+void uploadFrame(TileSet *, const unsigned char *);
+void stopPlayer(Player *);
+void writePlayReport(FILE *, Player *, double);
+void openShared(SharedSource *, const char *, size_t);
+#ifndef _WIN32
+struct ShmRing *mapRing(const char *, size_t *);
+#endif
+TileSet *showShared(SharedSource *);
+void closeShared(SharedSource *);
+void writeSharedReport(FILE *, SharedSource *);
+void startWatcher(Watcher *, const LoadOptions *, size_t);
+void watchImage(Watcher *, CachedImage *);
+void watchFile(void *);
+int waitForEvent(Watcher *, const char *);
+int refreshImage(Watcher *, CachedImage *);
+void refreshRows(TileSet *, unsigned int, unsigned int);
+void stopWatcher(Watcher *);
+void renderSoftware(Pixel *, int, int, const unsigned char *, Header, mat4x4, int, int,
+                    const ColorAdjust *);
+void colorTable(unsigned char *, const ColorAdjust *);
+void renderBand(void *);
+void computeHistogram(Histogram *, const unsigned char *, Header, int);
+void countSamples(void *);
+void naiveHistogram(Histogram *, const unsigned char *, Header);
+unsigned char *plotHistogram(const Histogram *);
+void writeHistogram(FILE *, const char *, const Histogram *);
+void overlayMatrix(mat4x4, int, int);
+void colorUniforms(Program *, const ColorAdjust *);
+GLuint weightTexture(void);
+void linkProgram(Program *, GLuint, int);
+double filterKernel(int, double);
+void sampleNearest(Pixel *, const RenderJob *, float, float);
+void sampleBilinear(Pixel *, const RenderJob *, float, float);
+void writeP6(FILE *, const Pixel *, int, int);
+int checkCapture(const char *, int, int, const unsigned char *, Header, mat4x4, int, int);
+int startThread(Thread *, ThreadFunc, void *);
+void joinThread(Thread);
+void initMutex(Mutex *);
+void destroyMutex(Mutex *);
+void lockMutex(Mutex *);
+void unlockMutex(Mutex *);
+void initCond(Cond *);
+void waitCond(Cond *, Mutex *);
+void broadcastCond(Cond *);
+void raiseFlag(Flag *);
+int takeFlag(Flag *);
+int cpuCount(void);
+int hasMipmaps(TileSet *, Tile *);
+size_t mipBytes(unsigned int, unsigned int, unsigned int);
+void uploadMipmaps(const unsigned char *, unsigned int, unsigned int, unsigned int, unsigned char *);
+void refreshMipmaps(TileSet *, Tile *, unsigned int, unsigned int);
+void downsample2x2(unsigned char *, const unsigned char *, unsigned int, unsigned int, int);
+#if defined(EZVIEW_SSE2) || defined(EZVIEW_AVX2)
+void meanBlocks(unsigned char *, const unsigned char *, const unsigned char *, size_t, size_t);
+void pickEven(unsigned char *, const unsigned char *, size_t);
+#endif
+int sameBytes(const unsigned char *, const unsigned char *, size_t);
+void createTexture(TileSet *, Tile *);
+void uploadCompressed(TileSet *, Tile *);
+void encodeTile(TileSet *, Tile *, int);
+size_t etc1Bytes(unsigned int, unsigned int);
+double encodeLevel(unsigned char *, const unsigned char *, unsigned int, unsigned int,
+                   unsigned int, int, int);
+void encodeBlocks(void *);
+unsigned int encodeBlock(unsigned char *, unsigned char [16][3], unsigned int, int);
+void fitHalf(Etc1Fit *, unsigned char [16][3], unsigned int, int, int, const int *, int, int);
+void writeEncodeStats(FILE *, const char *, const EncodeStats *);
+double encodePsnr(const EncodeStats *);
 
 // (-1, 1)  (1, 1)
 // (-1, -1) (1, -1)
@@ -55,8 +838,49 @@ const GLubyte indexes[] = {
   2, 3, 0
 };
 
+// Intensity modifiers of the ETC1 tables, small and large. Selectors 0 and
+// 1 add them, 2 and 3 subtract them.
+const int etc1_modifiers[8][2] = {
+  {2, 8}, {5, 17}, {9, 29}, {13, 42}, {18, 60}, {24, 80}, {33, 106}, {47, 183}
+};
+
 mat4x4 current_transform;
 
+// Set when something on screen changed and the frame must be drawn again.
+// The loader and watcher threads also set it, so it is only touched through
+// raiseFlag and takeFlag.
+Flag needs_redraw = 1;
+
+// Images to step by, set by the next and previous keys
+int browse_step = 0;
+
+// Toggled by space while --play runs
+int play_paused = 0;
+
+// Toggled by O
+int show_histogram = 0;
+
+// Set by --filter and L
+int sample_filter = FILTER_NEAREST;
+const char *filter_names[FILTER_COUNT] = {"nearest", "bicubic", "lanczos"};
+
+// Given the size of each tile's texture, border included, for the filters.
+// Set to that of the program in use.
+GLint tile_size_location = -1;
+
+// Set by the color keys
+#define COLOR_NEUTRAL {0, 1, 1, 1, 0, 0, 0}
+ColorAdjust color_adjust = COLOR_NEUTRAL;
+
+// Filled in from all threads while --trace is on
+Trace trace;
+
+// Number of the calling thread in the trace, or 0 until it records an event
+THREAD_LOCAL int trace_thread = 0;
+
+// Keys pressed in the window are appended here with --record
+FILE *record_file = NULL;
+
 //GLint mvp_location;
 
 static const char* vertex_shader_text =
@@ -70,12 +894,85 @@ static const char* vertex_shader_text =
 "    TexCoordOut = TexCoordIn;\n"
 "}\n";
 
+// Levels holds the black level, 1 / (white - black), contrast and
+// brightness, Tone 1 / gamma and whether to invert, and Channel selects a
+// channel to show as gray when its w is 1.
+//
+// FILTER is defined to one of the FILTER_ values before the text, and each
+// filter gets a program of its own so nearest sampling costs no more than
+// a fetch. The filters need highp to find their place within large tiles.
+// Bicubic and Lanczos are separable, so the weights along x and y are
+// looked up in Weights for the fraction of a texel the fragment is past a
+// texel center. The two middle taps along each axis, which both
+// weigh positive, are read as one GL_LINEAR fetch at the point between
+// them the Weights give. That leaves 9 fetches for bicubic instead of 16,
+// and 25 for Lanczos-3 instead of 36.
 static const char* fragment_shader_text =
+"#if FILTER != 0 && defined(GL_FRAGMENT_PRECISION_HIGH)\n"
+"precision highp float;\n"
+"#else\n"
+"precision mediump float;\n"
+"#endif\n"
 "varying highp vec2 TexCoordOut;\n"
 "uniform sampler2D Texture;\n"
+"uniform sampler2D Weights;\n"
+"uniform vec2 TileSize;\n"
+"uniform vec4 Levels;\n"
+"uniform vec2 Tone;\n"
+"uniform vec4 Channel;\n"
+"vec4 weights(float f, float row)\n"
+"{\n"
+"    vec2 at = vec2((f * 63.0 + 0.5) / 64.0, (row + 0.5) / 3.0);\n"
+"    return texture2D(Weights, at) * 1.5 - 0.25;\n"
+"}\n"
+"vec3 taps3(vec3 x, vec3 w, float y)\n"
+"{\n"
+"    return w.x * texture2D(Texture, vec2(x.x, y)).rgb +\n"
+"           w.y * texture2D(Texture, vec2(x.y, y)).rgb +\n"
+"           w.z * texture2D(Texture, vec2(x.z, y)).rgb;\n"
+"}\n"
+"vec3 taps5(vec4 x, float x4, vec4 w, float w4, float y)\n"
+"{\n"
+"    return w.x * texture2D(Texture, vec2(x.x, y)).rgb +\n"
+"           w.y * texture2D(Texture, vec2(x.y, y)).rgb +\n"
+"           w.z * texture2D(Texture, vec2(x.z, y)).rgb +\n"
+"           w.w * texture2D(Texture, vec2(x.w, y)).rgb +\n"
+"           w4 * texture2D(Texture, vec2(x4, y)).rgb;\n"
+"}\n"
 "void main()\n"
 "{\n"
-"    gl_FragColor = texture2D(Texture, TexCoordOut);\n"
+"#if FILTER == 1 || FILTER == 2\n"
+"    vec2 texel = TexCoordOut * TileSize - 0.5;\n"
+"    vec2 cell = floor(texel);\n"
+"    vec2 f = texel - cell;\n"
+"#endif\n"
+"#if FILTER == 1\n"
+"    vec4 wx = weights(f.x, 0.0), wy = weights(f.y, 0.0);\n"
+"    vec3 x = (cell.x + vec3(-0.5, 0.5 + wx.w, 2.5)) / TileSize.x;\n"
+"    vec3 y = (cell.y + vec3(-0.5, 0.5 + wy.w, 2.5)) / TileSize.y;\n"
+"    vec3 c = wy.x * taps3(x, wx.xyz, y.x) + wy.y * taps3(x, wx.xyz, y.y) +\n"
+"             wy.z * taps3(x, wx.xyz, y.z);\n"
+"    c /= dot(wx.xyz, vec3(1.0)) * dot(wy.xyz, vec3(1.0));\n"
+"#elif FILTER == 2\n"
+"    vec4 wx = weights(f.x, 1.0), wy = weights(f.y, 1.0);\n"
+"    vec2 ex = weights(f.x, 2.0).xy, ey = weights(f.y, 2.0).xy;\n"
+"    vec4 x = (cell.x + vec4(-1.5, -0.5, 0.5 + ex.y, 2.5)) / TileSize.x;\n"
+"    vec4 y = (cell.y + vec4(-1.5, -0.5, 0.5 + ey.y, 2.5)) / TileSize.y;\n"
+"    float x4 = (cell.x + 3.5) / TileSize.x, y4 = (cell.y + 3.5) / TileSize.y;\n"
+"    vec3 c = wy.x * taps5(x, x4, wx, ex.x, y.x) + wy.y * taps5(x, x4, wx, ex.x, y.y) +\n"
+"             wy.z * taps5(x, x4, wx, ex.x, y.z) + wy.w * taps5(x, x4, wx, ex.x, y.w) +\n"
+"             ey.x * taps5(x, x4, wx, ex.x, y4);\n"
+"    c /= (dot(wx, vec4(1.0)) + ex.x) * (dot(wy, vec4(1.0)) + ey.x);\n"
+"#else\n"
+"    vec3 c = texture2D(Texture, TexCoordOut).rgb;\n"
+"#endif\n"
+"    c = clamp((c - Levels.x) * Levels.y, 0.0, 1.0);\n"
+"    if (Tone.x != 1.0)\n"
+"        c = pow(c, vec3(Tone.x));\n"
+"    c = (c - 0.5) * Levels.z + 0.5 + Levels.w;\n"
+"    c = mix(c, vec3(dot(c, Channel.rgb)), Channel.a);\n"
+"    c = mix(c, 1.0 - c, Tone.y);\n"
+"    gl_FragColor = vec4(clamp(c, 0.0, 1.0), 1.0);\n"
 "}\n";
 
 static void error_callback(int error, const char* description)
@@ -85,12 +982,32 @@ static void error_callback(int error, const char* description)
 
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+    if (action == GLFW_PRESS || action == GLFW_REPEAT) {
+        raiseFlag(&needs_redraw);
+        // Letters, digits and the level keys can be replayed later with
+        // --replay. Keys replayed now come without a window and are not
+        // recorded again.
+        if (record_file != NULL && window != NULL && key > 0 && key < 128 &&
+            (isalnum(key) || strchr("[],.", key)))
+            fputc(key, record_file);
+    }
+    
     // Control
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
         glfwSetWindowShouldClose(window, GLFW_TRUE);
     if (key == GLFW_KEY_0 && action == GLFW_PRESS)
         mat4x4_identity(current_transform);
     
+    // Playback
+    if (key == GLFW_KEY_SPACE && action == GLFW_PRESS)
+        play_paused = !play_paused;
+    
+    // Browse
+    if ((key == GLFW_KEY_N || key == GLFW_KEY_RIGHT) && (action == GLFW_REPEAT || action == GLFW_PRESS))
+        browse_step++;
+    if ((key == GLFW_KEY_P || key == GLFW_KEY_LEFT) && (action == GLFW_REPEAT || action == GLFW_PRESS))
+        browse_step--;
+    
 	
 	// Rotate
 	if (key == GLFW_KEY_E && (action == GLFW_REPEAT || action == GLFW_PRESS)) {
@@ -199,15 +1116,78 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
         mat4x4_mul(current_transform, m, current_transform);
     }
     
+    // Color
+    if (key == GLFW_KEY_Z && (action == GLFW_REPEAT || action == GLFW_PRESS))
+        color_adjust.brightness -= 0.05f;
+    if (key == GLFW_KEY_X && (action == GLFW_REPEAT || action == GLFW_PRESS))
+        color_adjust.brightness += 0.05f;
+    if (key == GLFW_KEY_C && (action == GLFW_REPEAT || action == GLFW_PRESS))
+        color_adjust.contrast /= 1.1f;
+    if (key == GLFW_KEY_V && (action == GLFW_REPEAT || action == GLFW_PRESS))
+        color_adjust.contrast *= 1.1f;
+    if (key == GLFW_KEY_B && (action == GLFW_REPEAT || action == GLFW_PRESS))
+        color_adjust.gamma /= 1.1f;
+    if (key == GLFW_KEY_M && (action == GLFW_REPEAT || action == GLFW_PRESS))
+        color_adjust.gamma *= 1.1f;
+    // Levels stay in 0..1 and at least 0.02 apart
+    if (key == GLFW_KEY_LEFT_BRACKET && (action == GLFW_REPEAT || action == GLFW_PRESS))
+        color_adjust.black = color_adjust.black > 0.02f ? color_adjust.black - 0.02f : 0;
+    if (key == GLFW_KEY_RIGHT_BRACKET && (action == GLFW_REPEAT || action == GLFW_PRESS)
+        && color_adjust.black + 0.04f <= color_adjust.white)
+        color_adjust.black += 0.02f;
+    if (key == GLFW_KEY_COMMA && (action == GLFW_REPEAT || action == GLFW_PRESS)
+        && color_adjust.white - 0.04f >= color_adjust.black)
+        color_adjust.white -= 0.02f;
+    if (key == GLFW_KEY_PERIOD && (action == GLFW_REPEAT || action == GLFW_PRESS))
+        color_adjust.white = color_adjust.white < 0.98f ? color_adjust.white + 0.02f : 1;
+    if (key == GLFW_KEY_3 && action == GLFW_PRESS)
+        color_adjust.channel = 1;
+    if (key == GLFW_KEY_4 && action == GLFW_PRESS)
+        color_adjust.channel = 2;
+    if (key == GLFW_KEY_5 && action == GLFW_PRESS)
+        color_adjust.channel = 3;
+    if (key == GLFW_KEY_6 && action == GLFW_PRESS)
+        color_adjust.channel = 0;
+    if (key == GLFW_KEY_I && action == GLFW_PRESS)
+        color_adjust.invert = !color_adjust.invert;
+    if (key == GLFW_KEY_9 && action == GLFW_PRESS) {
+        ColorAdjust neutral = COLOR_NEUTRAL;
+        color_adjust = neutral;
+    }
+    
+    // Overlay
+    if (key == GLFW_KEY_O && action == GLFW_PRESS)
+        show_histogram = !show_histogram;
+    
+    // Filter
+    if (key == GLFW_KEY_L && action == GLFW_PRESS) {
+        sample_filter = (sample_filter + 1) % FILTER_COUNT;
+        printf("Filter: %s\n", filter_names[sample_filter]);
+        fflush(stdout);
+    }
+    
     
 }
 
+// The window was resized or uncovered
+static void framebuffer_size_callback(GLFWwindow* window, int width, int height)
+{
+    raiseFlag(&needs_redraw);
+}
+
+static void refresh_callback(GLFWwindow* window)
+{
+    raiseFlag(&needs_redraw);
+}
+
 void glCompileShaderOrDie(GLuint shader) {
   GLint compiled;
+  TRACE_BEGIN("glCompileShader");
   glCompileShader(shader);
   glGetShaderiv(shader,
 		GL_COMPILE_STATUS,
 		&compiled);
+  TRACE_END("glCompileShader");
   if (!compiled) {
     GLint infoLen = 0;
     glGetShaderiv(shader,
@@ -225,55 +1205,350 @@ void glCompileShaderOrDie(GLuint shader) {
 int main(int argc, char *argv[])
 {
 
-   if (argc != 2) {
-     fprintf(stderr, "Error: Incorrect number of arguments.\n");
-     printf("Usage: ezview inputFile\n");
+   char **inputs = malloc(sizeof(char *) * argc);
+   int inputCount = 0;
+   size_t cacheBudget = (size_t) CACHE_BUDGET_MB << 20;
+   size_t tileBudget = (size_t) TILE_BUDGET_MB << 20;
+   int continuous = 0;
+   const char *keys = "";
+   const char *renderPath = NULL;
+   const char *capturePath = NULL;
+   int tolerance = CAPTURE_TOLERANCE;
+   int captureStatus = 0;
+   int renderWidth = 640, renderHeight = 480;
+   int bilinear = 0;
+   int threads = cpuCount();
+   int benchFrames = 0;
+   unsigned int kernelWidth = 0, kernelHeight = 0;
+   double playRate = 0;
+   const char *shmName = NULL;
+   int watch = 0;
+   int etc1 = 0;
+   int filter = FILTER_NEAREST;
+   int diskCache = 1;
+   unsigned int preview = 1;
+   Region crop = {0, 0, 0, 0, 1};
+   int cropped = 0;
+   const char *recordPath = NULL;
+   const char *replayPath = NULL;
+   const char *tracePath = NULL;
+   
+   for (int i = 1; i < argc; i++) {
+     if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+       benchFrames = atoi(argv[++i]);
+       if (benchFrames <= 0) {
+         fprintf(stderr, "Error: Benchmark needs at least one frame.\n");
+         return(1);
+       }
+     }
+     else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+       capturePath = argv[++i];
+     }
+     else if (strcmp(argv[i], "--bench-kernels") == 0 && i + 1 < argc) {
+       if (sscanf(argv[++i], "%ux%u", &kernelWidth, &kernelHeight) != 2 ||
+           kernelWidth == 0 || kernelHeight == 0 ||
+           !sizeFits(kernelWidth, kernelHeight, 3 * 4)) {
+         fprintf(stderr, "Error: Benchmark size must be WIDTHxHEIGHT.\n");
+         return(1);
+       }
+     }
+     else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+       tileBudget = (size_t) strtoul(argv[++i], NULL, 10) << 20;
+     }
+     else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+       cacheBudget = (size_t) strtoul(argv[++i], NULL, 10) << 20;
+     }
+     else if (strcmp(argv[i], "--crop") == 0 && i + 1 < argc) {
+       if (sscanf(argv[++i], "%ux%u+%u+%u", &crop.width, &crop.height, &crop.x, &crop.y) != 4 ||
+           crop.width == 0 || crop.height == 0) {
+         fprintf(stderr, "Error: Crop must be WIDTHxHEIGHT+X+Y.\n");
+         return(1);
+       }
+       cropped = 1;
+     }
+     else if (strcmp(argv[i], "--continuous") == 0) {
+       continuous = 1;
+     }
+     else if (strcmp(argv[i], "--no-disk-cache") == 0) {
+       diskCache = 0;
+     }
+     else if (strcmp(argv[i], "--etc1") == 0 && i + 1 < argc) {
+       i++;
+       if (strcmp(argv[i], "fast") == 0) {
+         etc1 = ETC1_FAST;
+       }
+       else if (strcmp(argv[i], "best") == 0) {
+         etc1 = ETC1_BEST;
+       }
+       else {
+         fprintf(stderr, "Error: ETC1 effort must be fast or best.\n");
+         return(1);
+       }
+     }
+     else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+       i++;
+       for (filter = 0; filter < FILTER_COUNT && strcmp(argv[i], filter_names[filter]) != 0; filter++)
+         ;
+       if (filter == FILTER_COUNT) {
+         fprintf(stderr, "Error: Filter must be nearest, bicubic or lanczos.\n");
+         return(1);
+       }
+     }
+     else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) {
+       keys = argv[++i];
+     }
+     else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc) {
+       playRate = atof(argv[++i]);
+       if (playRate <= 0) {
+         fprintf(stderr, "Error: Playback needs a positive frame rate.\n");
+         return(1);
+       }
+     }
+     else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc) {
+       int step = atoi(argv[++i]);
+       if (step < 1) {
+         fprintf(stderr, "Error: Preview must be a positive factor.\n");
+         return(1);
+       }
+       preview = step;
+     }
+     else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+       recordPath = argv[++i];
+     }
+     else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+       renderPath = argv[++i];
+     }
+     else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+       replayPath = argv[++i];
+     }
+     else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+       shmName = argv[++i];
+     }
+     else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+       if (sscanf(argv[++i], "%dx%d", &renderWidth, &renderHeight) != 2 ||
+           renderWidth <= 0 || renderHeight <= 0) {
+         fprintf(stderr, "Error: Size must be WIDTHxHEIGHT.\n");
+         return(1);
+       }
+     }
+     else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+       i++;
+       if (strcmp(argv[i], "bilinear") == 0) {
+         bilinear = 1;
+       }
+       else if (strcmp(argv[i], "nearest") != 0) {
+         fprintf(stderr, "Error: Sampling must be nearest or bilinear.\n");
+         return(1);
+       }
+     }
+     else if (strcmp(argv[i], "--watch") == 0) {
+       watch = 1;
+     }
+     else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+       tolerance = atoi(argv[++i]);
+       if (tolerance < 0 || tolerance > 255) {
+         fprintf(stderr, "Error: Tolerance must be from 0 to 255.\n");
+         return(1);
+       }
+     }
+     else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+       tracePath = argv[++i];
+#ifdef EZVIEW_NO_TRACE
+       fprintf(stderr, "Error: Tracing was left out of this build.\n");
+       return(1);
+#endif
+     }
+     else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+       threads = atoi(argv[++i]);
+       threads = threads > 0 ? threads : 1;
+     }
+     else if (strncmp(argv[i], "--", 2) == 0) {
+       fprintf(stderr, "Error: Unknown option %s.\n", argv[i]);
+       return(1);
+     }
+     else {
+       inputs[inputCount++] = argv[i];
+     }
+   }
+   
+   // Directories are replaced by the images in them
+   char **paths = NULL;
+   int pathCount = inputCount > 0 ? listImages(&paths, inputs, inputCount) : 0;
+   if (pathCount == 0 && shmName == NULL) {
+     fprintf(stderr, "Error: No input files.\n");
+     printf("Usage: ezview [--bench FRAMES] [--bench-kernels WxH] [--budget MB] [--cache MB]\n"
+            "              [--capture out.ppm] [--continuous] [--crop WxH+X+Y] [--etc1 fast|best]\n"
+            "              [--filter nearest|bicubic|lanczos] [--keys KEYS] [--no-disk-cache]\n"
+            "              [--play FPS] [--preview N] [--record FILE] [--render out.ppm]\n"
+            "              [--replay FILE] [--shm NAME] [--size WxH] [--sample nearest|bilinear]\n"
+            "              [--threads N] [--tolerance N] [--trace FILE] [--watch]\n"
+            "              inputFile... | directory\n");
+     return(1);
+   }
+   if (playRate > 0 && benchFrames > 0) {
+     fprintf(stderr, "Error: --play and --bench cannot be combined.\n");
+     return(1);
+   }
+   if (shmName != NULL && (playRate > 0 || benchFrames > 0 || kernelWidth > 0 ||
+                           renderPath != NULL)) {
+     fprintf(stderr, "Error: --shm cannot be combined with --play, --bench, --bench-kernels or "
+             "--render.\n");
+     return(1);
+   }
+   if (watch && (shmName != NULL || playRate > 0 || benchFrames > 0 || renderPath != NULL)) {
+     fprintf(stderr, "Error: --watch cannot be combined with --shm, --play, --bench or --render.\n");
+     return(1);
+   }
+   if (capturePath != NULL && (renderPath != NULL || benchFrames > 0 || kernelWidth > 0 ||
+                               playRate > 0 || shmName != NULL || watch)) {
+     fprintf(stderr, "Error: --capture cannot be combined with --render, --bench, --bench-kernels, "
+             "--play, --shm or --watch.\n");
+     return(1);
+   }
+   if (etc1 != 0 && (watch || shmName != NULL || playRate > 0)) {
+     fprintf(stderr, "Error: --etc1 cannot be combined with --watch, --shm or --play.\n");
      return(1);
    }
    
-  FILE* input = fopen(argv[1], "r");
-  if (input == NULL) {
-    fprintf(stderr, "Error: Unable to open input file.");
+  if (tracePath != NULL) {
+    startTrace();
+  }
+  
+  // Keys replayed one per frame by --bench
+  const char *script = NULL;
+  if (replayPath != NULL && (script = readKeyFile(replayPath)) == NULL) {
+    fprintf(stderr, "Error: Unable to read replay file.\n");
     return 1;
   }
-    
-  // Get header information from input file
-  Header inHeader = parseHeader(input);
   
-  if (inHeader.maxColor > 255) {
-    fprintf(stderr, "Error: Maximum color greater than 255 not supported.\n");
+  // Decoding runs in the background so the window can open right away
+  BenchReport report;
+  double started = nowSeconds();
+  ImageCache cache;
+  // --render needs no overview, as it draws from the pixels
+  LoadOptions options = {threads, diskCache, preview, crop, cropped,
+                         renderPath == NULL ? tileBudget : 0};
+  initCache(&cache, paths, pathCount, cacheBudget, &options);
+  int shownIndex = 0;
+  CachedImage *shown = NULL;
+  // Files that cannot be opened are passed over
+  while (shownIndex < pathCount && (shown = cacheImage(&cache, shownIndex)) == NULL) {
+    fprintf(stderr, "Error: Unable to open %s.\n", paths[shownIndex]);
+    shownIndex++;
+  }
+  if (pathCount > 0 && shown == NULL) {
     return 1;
   }
+  // Shared frames need no file, and show nothing until the first arrives
+  Loader *image = shown != NULL ? &shown->loader : NULL;
+  Header inHeader = image != NULL ? image->header : (Header) {6, 1, 1, 255, 3};
+  SharedSource shared;
+  if (shmName != NULL) {
+    openShared(&shared, shmName, tileBudget);
+    continuous = 1;
+  }
+  report.load = nowSeconds() - started;
+  
+  // The kernels are timed on the decoded pixels alone, without a window
+  if (kernelWidth > 0) {
+    waitForImage(image);
+    if (loadFailed(&image->progress)) {
+      return 1;
+    }
+    return benchKernels(stdout, image->path, image->pixels, inHeader, kernelWidth, kernelHeight,
+                        threads) ? 0 : 1;
+  }
+  
+  // A benchmark times decoding on its own, before the GL is set up
+  if (benchFrames > 0) {
+    started = nowSeconds();
+    waitForImage(image);
+    report.decode = nowSeconds() - started;
+    if (loadFailed(&image->progress)) {
+      return 1;
+    }
+    
+    // The statistics pass, and a plain loop to compare it with
+    Histogram naive;
+    started = nowSeconds();
+    computeHistogram(&shown->histogram, image->pixels, inHeader, threads);
+    report.histogram = nowSeconds() - started;
+    shown->hasHistogram = 1;
+    started = nowSeconds();
+    naiveHistogram(&naive, image->pixels, inHeader);
+    report.histogramNaive = nowSeconds() - started;
+    report.histogramMatches =
+      memcmp(naive.bins, shown->histogram.bins, sizeof(naive.bins)) == 0 &&
+      memcmp(naive.min, shown->histogram.min, sizeof(naive.min)) == 0 &&
+      memcmp(naive.max, shown->histogram.max, sizeof(naive.max)) == 0;
+    
+    report.frames = malloc(sizeof(double) * benchFrames);
+    if (report.frames == NULL) {
+      fprintf(stderr, "Error: Unable to allocate memory.\n");
+      return 1;
+    }
+    if (script == NULL || script[0] == '\0')
+      script = BENCH_SCRIPT;
+    continuous = 1;
+  }
   
-  // Create buffer and read data from input using appropriate function.
-  Pixel *buffer = malloc(sizeof(Pixel) * inHeader.width * inHeader.height);
-  if (inHeader.magicNumber == 3) {
-    readP3(buffer, inHeader, input);
+  // --capture keeps drawing until the whole image is up
+  if (capturePath != NULL) {
+    continuous = 1;
   }
-  else if (inHeader.magicNumber == 6) {
-    readP6(buffer, inHeader, input);
+  
+  // Start from the view reached by pressing keys
+  mat4x4_identity(current_transform);
+  sample_filter = filter;
+  replayKeys(keys);
+  if (script != NULL && benchFrames == 0)
+    replayKeys(script);
+  
+  if (recordPath != NULL && (record_file = fopen(recordPath, "a")) == NULL) {
+    fprintf(stderr, "Error: Unable to open record file.\n");
+    return 1;
   }
-  else {
-    fprintf(stderr, "Error: Input magic number not supported.\n");
+  
+  // Without a GPU the view is rasterized on the CPU and written out
+  if (renderPath != NULL) {
+    mat4x4 mvp;
+    Pixel *out = malloc(sizeof(Pixel) * (size_t) renderWidth * renderHeight);
+    FILE *output = fopen(renderPath, "wb");
+    if (out == NULL || output == NULL) {
+      fprintf(stderr, "Error: Unable to create output file.\n");
+      return 1;
+    }
+    viewMatrix(mvp, renderWidth, renderHeight);
+    waitForImage(image);
+    if (loadFailed(&image->progress)) {
+      return 1;
+    }
+    renderSoftware(out, renderWidth, renderHeight, image->pixels, inHeader, mvp, bilinear, threads,
+                   &color_adjust);
+    TRACE_BEGIN("writeP6");
+    writeP6(output, out, renderWidth, renderHeight);
+    if (fclose(output) != 0) {
+      fprintf(stderr, "Error: Unable to write output file.\n");
+      return 1;
+    }
+    TRACE_END("writeP6");
+    free(out);
+    closeImage(image);
+    if (tracePath != NULL && !writeTrace(tracePath)) {
+      fprintf(stderr, "Error: Unable to write trace file.\n");
+      return 1;
+    }
+    return 0;
   }
-    fclose(input);
-
-
-    unsigned char *raw_data = malloc(sizeof(unsigned char)*4*inHeader.width * inHeader.height);
-    for (int i=0; i<inHeader.width * inHeader.height;i++) {
-	  raw_data[i*4] = buffer[i].red;
-	  raw_data[i*4+1] = buffer[i].green;
-	  raw_data[i*4+2] = buffer[i].blue;
-	  raw_data[i*4+3] = 255;
-	}
 
 
     GLFWwindow* window;
-    GLuint vertex_buffer, index_buffer, vertex_shader, fragment_shader, program;
-    GLint mvp_location, vpos_location, vcol_location;
+    GLuint vertex_buffer, index_buffer, vertex_shader;
+    GLint vpos_location, vcol_location;
 
     glfwSetErrorCallback(error_callback);
 
+    TRACE_BEGIN("create window");
     if (!glfwInit())
         exit(EXIT_FAILURE);
 
@@ -282,8 +1557,10 @@ int main(int argc, char *argv[])
     glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+    // Nothing needs to be seen while benchmarking
+    glfwWindowHint(GLFW_VISIBLE, benchFrames > 0 ? GLFW_FALSE : GLFW_TRUE);
 
-    window = glfwCreateWindow(640, 480, "EZ Viewer", NULL, NULL);
+    window = glfwCreateWindow(renderWidth, renderHeight, "EZ Viewer", NULL, NULL);
     if (!window)
     {
         glfwTerminate();
@@ -291,21 +1568,49 @@ int main(int argc, char *argv[])
     }
 
     glfwSetKeyCallback(window, key_callback);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetWindowRefreshCallback(window, refresh_callback);
 
     glfwMakeContextCurrent(window);
     // gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    glfwSwapInterval(1);
+    // Frames are timed without waiting for vsync
+    glfwSwapInterval(benchFrames > 0 ? 0 : 1);
+    TRACE_END("create window");
+    
+    // ETC1 is an extension in GLES2. Without it tiles go up uncompressed.
+    if (etc1 != 0 && !glfwExtensionSupported("GL_OES_compressed_ETC1_RGB8_texture")) {
+      fprintf(stderr, "Warning: ETC1 textures are not supported, so --etc1 is ignored.\n");
+      etc1 = 0;
+    }
+    
+    // Finished bands can now be shown as they arrive
+    if (image != NULL) {
+      lockMutex(&image->progress.mutex);
+      image->progress.notify = 1;
+      unlockMutex(&image->progress.mutex);
+    }
 
     // NOTE: OpenGL error checks have been omitted for brevity
      
-    // Create Buffer
-    glGenBuffers(1, &vertex_buffer);
-
-    // Map GL_ARRAY_BUFFER to this buffer
-    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-
-    // Send the data
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertexes), vertexes, GL_STATIC_DRAW);
+    // Split the image into tiles, which also creates and binds the buffer
+    // holding their quads
+    TileSet *tiles = shown != NULL ? &shown->tiles : NULL;
+    if (tiles != NULL) {
+      TRACE_BEGIN("initTiles");
+      initTiles(tiles, inHeader.width, inHeader.height, inHeader.channels, image->pixels,
+                tileBudget);
+      tiles->live = watch;
+      tiles->compression = etc1;
+      tiles->threads = threads;
+      shown->hasTiles = 1;
+      vertex_buffer = tiles->vertexBuffer;
+      TRACE_END("initTiles");
+    }
+    
+    int prefetched = -1;
+    // Images that fail to decode are passed over in the direction browsed,
+    // until every other file has been tried
+    int browseDirection = 1, skipped = 0;
 
     glGenBuffers(1, &index_buffer);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
@@ -315,29 +1620,18 @@ int main(int argc, char *argv[])
     glShaderSource(vertex_shader, 1, &vertex_shader_text, NULL);
     glCompileShaderOrDie(vertex_shader);
 
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment_shader, 1, &fragment_shader_text, NULL);
-    glCompileShaderOrDie(fragment_shader);
-
-    program = glCreateProgram();
-    glAttachShader(program, vertex_shader);
-    glAttachShader(program, fragment_shader);
-    glLinkProgram(program);
-    // more error checking! glLinkProgramOrDie!
-
-    mvp_location = glGetUniformLocation(program, "MVP");
-    printf("%d\n", mvp_location);
-    assert(mvp_location != -1);
+    // One program per filter, all with the same attribute locations
+    Program programs[FILTER_COUNT];
+    for (int f = 0; f < FILTER_COUNT; f++) {
+      linkProgram(&programs[f], vertex_shader, f);
+    }
 
-    vpos_location = glGetAttribLocation(program, "vPos");
+    vpos_location = glGetAttribLocation(programs[0].id, "vPos");
     assert(vpos_location != -1);
 
-    GLint texcoord_location = glGetAttribLocation(program, "TexCoordIn");
+    GLint texcoord_location = glGetAttribLocation(programs[0].id, "TexCoordIn");
     assert(texcoord_location != -1);
 
-    GLint tex_location = glGetUniformLocation(program, "Texture");
-    assert(tex_location != -1);
-
     glEnableVertexAttribArray(vpos_location);
     glVertexAttribPointer(vpos_location,
 			  2,
@@ -354,131 +1648,5367 @@ int main(int argc, char *argv[])
                           sizeof(Vertex),
 			  (void*) (sizeof(float) * 2));
     
-    int image_width = 5;
-    int image_height = 5;
-
-    GLuint texID;
-    glGenTextures(1, &texID);
-    glBindTexture(GL_TEXTURE_2D, texID);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-    //glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image_width, image_height, 0, GL_RGB, 
-	//	 GL_UNSIGNED_BYTE, image);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, inHeader.width, inHeader.height, 0, GL_RGBA, 
-		 GL_UNSIGNED_BYTE, raw_data);
-
+    // Filter weights stay bound to the second unit, tiles use the first
+    glActiveTexture(GL_TEXTURE1);
+    weightTexture();
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texID);
-    glUniform1i(tex_location, 0);
     
-    mat4x4_identity(current_transform);
+    // Playback shows the first image until the sequence starts, and draws
+    // on every refresh
+    Player player;
+    double titled = 0;
+    unsigned long titledFrames = 0;
+    if (playRate > 0) {
+      startPlayer(&player, paths, pathCount, &options, inHeader, playRate, threads, tileBudget);
+      continuous = 1;
+    }
+
+    // The file shown is decoded again when it changes on disk
+    Watcher watcher;
+    if (watch) {
+      startWatcher(&watcher, &options, tileBudget);
+      watchImage(&watcher, shown);
+    }
 
+    int frame = 0;
     while (!glfwWindowShouldClose(window))
     {
-        float ratio, imgratio;
+        float imgratio;
         int width, height;
-        mat4x4 m, p, mvp;
+        mat4x4 mvp;
+        
+        // A static image is only drawn again when something changed. The
+        // flag is cleared before drawing, so a change made meanwhile is
+        // drawn by the next frame.
+        if (!takeFlag(&needs_redraw) && !continuous) {
+            glfwWaitEvents();
+            continue;
+        }
+        TRACE_BEGIN("frame");
+        
+        // Show another image, which is usually decoded already
+        if (browse_step != 0 && playRate == 0 && shown != NULL) {
+          int next = shownIndex + browse_step;
+          CachedImage *entry = NULL;
+          browseDirection = browse_step > 0 ? 1 : -1;
+          browse_step = 0;
+          for (int tries = 0; entry == NULL && tries < pathCount; tries++) {
+            next = (next % pathCount + pathCount) % pathCount;
+            if ((entry = cacheImage(&cache, next)) == NULL) {
+              fprintf(stderr, "Error: Unable to open %s.\n", paths[next]);
+              next += browseDirection;
+            }
+          }
+          if (entry != NULL && entry != shown) {
+            TRACE_BEGIN("switch image");
+            lockMutex(&image->progress.mutex);
+            image->progress.notify = 0;
+            unlockMutex(&image->progress.mutex);
+            
+            shown = entry;
+            shownIndex = next;
+            image = &shown->loader;
+            inHeader = image->header;
+            tiles = &shown->tiles;
+            lockMutex(&image->progress.mutex);
+            image->progress.notify = 1;
+            unlockMutex(&image->progress.mutex);
+            if (!shown->hasTiles) {
+              initTiles(tiles, inHeader.width, inHeader.height, inHeader.channels,
+                        image->pixels, tileBudget);
+              tiles->live = watch;
+              tiles->compression = etc1;
+              tiles->threads = threads;
+              shown->hasTiles = 1;
+            }
+            if (watch) {
+              watchImage(&watcher, shown);
+            }
+            glfwSetWindowTitle(window, paths[shownIndex]);
+            
+            evictImages(&cache, shownIndex);
+            TRACE_END("switch image");
+          }
+        }
+        
+        // Every frame after the first steps through the script
+        if (benchFrames > 0) {
+          if (frame > 0)
+            replayKey(script[(frame - 1) % strlen(script)]);
+          started = nowSeconds();
+        }
 
         glfwGetFramebufferSize(window, &width, &height);
-        ratio = width / (float) height;
         
 		imgratio = inHeader.width / (float) inHeader.height;
 
         glViewport(0, 0, width, height);
         glClear(GL_COLOR_BUFFER_BIT);
 
-        mat4x4_identity(mvp);
-        mat4x4_ortho(p, -ratio, ratio, -1.f, 1.f, 1.f, -1.f);
-        mat4x4_mul(mvp, p, mvp);
-        mat4x4_mul(mvp, current_transform, mvp);
+        viewMatrix(mvp, width, height);
 
-        glUseProgram(program);
-        glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
-        glDrawArrays(GL_TRIANGLES, 0, 6);
+        Program *drawing = &programs[sample_filter];
+        glUseProgram(drawing->id);
+        glUniformMatrix4fv(drawing->mvp, 1, GL_FALSE, (const GLfloat*) mvp);
+        tile_size_location = drawing->tileSize;
+        
+        // Color adjustments are applied as the image is drawn, so changing
+        // them re-uploads nothing but these
+        colorUniforms(drawing, &color_adjust);
+        
+        // A sequence being played, or frames from shared memory, take over
+        // once their first frame is in
+        TileSet *frameTiles = NULL;
+        if (playRate > 0) {
+          player.paused = play_paused;
+          browse_step = 0;
+          frameTiles = showFrame(&player, nowSeconds());
+        }
+        if (shmName != NULL) {
+          frameTiles = showShared(&shared);
+        }
+        if (frameTiles != NULL) {
+          bindTiles(frameTiles, vpos_location, texcoord_location);
+          drawTiles(frameTiles, mvp);
+          
+          // The rate over the last second goes in the title
+          double now = nowSeconds();
+          if (now - titled >= 1) {
+            char title[256];
+            if (playRate > 0) {
+              snprintf(title, sizeof(title), "%s - %.1f fps, %lu dropped",
+                       paths[player.shown % pathCount],
+                       (player.displayed - titledFrames) / (now - titled), player.dropped);
+              titledFrames = player.displayed;
+            }
+            else {
+              snprintf(title, sizeof(title), "%s - frame %llu, %.1f fps, %lu dropped", shmName,
+                       shared.frame, (shared.displayed - titledFrames) / (now - titled),
+                       shared.dropped);
+              titledFrames = shared.displayed;
+            }
+            glfwSetWindowTitle(window, title);
+            titled = now;
+          }
+        }
+        else if (shown != NULL) {
+          if (watch && refreshImage(&watcher, shown)) {
+            inHeader = image->header;
+          }
+          tiles->rowsReady = readyRows(&image->progress);
+          TRACE_COUNTER("rows ready", tiles->rowsReady);
+          
+          int decoded = tiles->rowsReady == inHeader.height;
+          int failed = loadFailed(&image->progress);
+          if (decoded) {
+            skipped = 0;
+          }
+          
+          // An image that failed keeps the rows decoded before the error,
+          // which are shown alone, or it is passed over once while browsing
+          if (failed && !shown->passedOver && skipped < pathCount - 1) {
+            shown->passedOver = 1;
+            skipped++;
+            browse_step = browseDirection;
+            raiseFlag(&needs_redraw);
+          }
+          
+          // Files that cannot be read decimated get their overview once
+          // decoded
+          if (image->overview > 0 && image->preview == NULL && decoded &&
+              image->pixels != NULL) {
+            readOverview(image);
+          }
+          
+          // A preview stands in until the image is decoded, then stays under
+          // its tiles while they go up one per frame. An overview stays for
+          // good, out of the budget of the tiles.
+          if (image->preview != NULL && !shown->hasPreviewTiles) {
+            Header p = image->previewHeader;
+            initTiles(&shown->previewTiles, p.width, p.height, p.channels, image->preview,
+                      tileBudget);
+            shown->previewTiles.rowsReady = p.height;
+            shown->hasPreviewTiles = 1;
+            if (image->overview > 0) {
+              tiles->budget = tileBudget - tileBudget / OVERVIEW_SHARE;
+            }
+          }
+          if (shown->hasPreviewTiles) {
+            bindTiles(&shown->previewTiles, vpos_location, texcoord_location);
+            drawTiles(&shown->previewTiles, mvp);
+          }
+          tiles->uploadLimit = shown->hasPreviewTiles ? 1 : 0;
+          if (!shown->hasPreviewTiles || decoded) {
+            bindTiles(tiles, vpos_location, texcoord_location);
+            drawTiles(tiles, mvp);
+          }
+          if (shown->hasPreviewTiles && decoded && tiles->pending == 0 && image->overview == 0) {
+            freeTiles(&shown->previewTiles);
+            shown->hasPreviewTiles = 0;
+            free(image->preview);
+            image->preview = NULL;
+          }
+          else if (shown->hasPreviewTiles && decoded && tiles->pending > 0) {
+            raiseFlag(&needs_redraw);
+          }
+          TRACE_COUNTER("resident MB", tiles->residentBytes / 1048576.0);
+          
+          // Tiles encoded are reported once the view is complete again
+          if (tiles->encoded.tiles != tiles->encoded.reported && tiles->pending == 0 &&
+              benchFrames == 0) {
+            writeEncodeStats(stdout, paths[shownIndex], &tiles->encoded);
+            tiles->encoded.reported = tiles->encoded.tiles;
+          }
+          
+          // Statistics are gathered once the image is decoded, while its
+          // pixels are still at hand
+          if (!shown->hasHistogram && decoded && image->pixels != NULL) {
+            TRACE_BEGIN("computeHistogram");
+            computeHistogram(&shown->histogram, image->pixels, inHeader, threads);
+            TRACE_END("computeHistogram");
+            shown->hasHistogram = 1;
+          }
+          
+          // The histogram goes in the bottom left corner, untouched by the
+          // view and the color keys
+          if (show_histogram && shown->hasHistogram) {
+            if (!shown->hasHistogramTiles) {
+              shown->histogramPlot = plotHistogram(&shown->histogram);
+              initTiles(&shown->histogramTiles, HISTOGRAM_PLOT_WIDTH, HISTOGRAM_PLOT_HEIGHT, 3,
+                        shown->histogramPlot, tileBudget);
+              shown->histogramTiles.rowsReady = HISTOGRAM_PLOT_HEIGHT;
+              shown->hasHistogramTiles = 1;
+              writeHistogram(stdout, paths[shownIndex], &shown->histogram);
+            }
+            ColorAdjust neutral = COLOR_NEUTRAL;
+            mat4x4 corner;
+            overlayMatrix(corner, width, height);
+            Program *overlay = &programs[FILTER_NEAREST];
+            glUseProgram(overlay->id);
+            glUniformMatrix4fv(overlay->mvp, 1, GL_FALSE, (const GLfloat*) corner);
+            colorUniforms(overlay, &neutral);
+            tile_size_location = overlay->tileSize;
+            bindTiles(&shown->histogramTiles, vpos_location, texcoord_location);
+            drawTiles(&shown->histogramTiles, corner);
+          }
+          
+          // Once an image that fits in one texture is fully uploaded, the GL
+          // holds the only copy. Larger images keep the source to stream
+          // from, and watched ones to compare the next version with.
+          if (!watch && capturePath == NULL && tiles->pixels != NULL &&
+              tiles->columns * tiles->rows == 1 &&
+              tiles->tiles[0].rowsUploaded == inHeader.height) {
+            freePixels(image);
+            tiles->pixels = NULL;
+            evictImages(&cache, shownIndex);
+          }
+          
+          // The neighbors are decoded once the image shown is done with the
+          // processors
+          if (prefetched != shownIndex && (decoded || failed)) {
+            prefetchImages(&cache, shownIndex);
+            prefetched = shownIndex;
+          }
+        }
+        
+        // The first frame with the whole image uploaded is read back and
+        // checked against the CPU renderer
+        if (capturePath != NULL && shown != NULL) {
+          if (loadFailed(&image->progress)) {
+            captureStatus = 1;
+            glfwSetWindowShouldClose(window, GLFW_TRUE);
+          }
+          else if (tiles->rowsReady == inHeader.height && tiles->pending == 0) {
+            captureStatus = !checkCapture(capturePath, width, height, image->pixels, inHeader,
+                                          mvp, threads, tolerance);
+            glfwSetWindowShouldClose(window, GLFW_TRUE);
+          }
+        }
+        
+        if (benchFrames > 0) {
+          glFinish();
+          if (frame == 0)
+            report.upload = nowSeconds() - started;
+          else
+            report.frames[frame - 1] = nowSeconds() - started;
+          if (frame++ == benchFrames)
+            glfwSetWindowShouldClose(window, GLFW_TRUE);
+        }
 
+        TRACE_BEGIN("glfwSwapBuffers");
         glfwSwapBuffers(window);
+        TRACE_END("glfwSwapBuffers");
+        TRACE_END("frame");
         glfwPollEvents();
     }
+    
+    if (benchFrames > 0) {
+      report.path = paths[shownIndex];
+      report.header = inHeader;
+      glfwGetFramebufferSize(window, &report.windowWidth, &report.windowHeight);
+      report.threads = threads;
+      report.renderer = (const char *) glGetString(GL_RENDERER);
+      report.frameCount = frame > 0 ? frame - 1 : 0;
+      report.filter = sample_filter;
+      report.compression = etc1;
+      report.encoded = tiles->encoded;
+      report.tracing = trace.enabled;
+      if (trace.enabled) {
+        lockMutex(&trace.mutex);
+        report.traceEvents = (unsigned long) (trace.count + trace.dropped);
+        unlockMutex(&trace.mutex);
+      }
+      writeBenchReport(stdout, &report);
+    }
+    if (playRate > 0) {
+      stopPlayer(&player);
+      writePlayReport(stdout, &player, nowSeconds());
+    }
+    if (shmName != NULL) {
+      writeSharedReport(stdout, &shared);
+      closeShared(&shared);
+    }
+    if (watch) {
+      stopWatcher(&watcher);
+    }
+    if (record_file != NULL)
+      fclose(record_file);
+    if (tracePath != NULL && !writeTrace(tracePath))
+      fprintf(stderr, "Error: Unable to write trace file.\n");
 
     glfwDestroyWindow(window);
 
     glfwTerminate();
-    exit(EXIT_SUCCESS);
+    exit(captureStatus == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
-// Parses the data in the header and moves the position to the
-// beginning of the data.
-Header parseHeader(FILE *fh) {
-  Header h;
+// Parses the data in the header into h and moves the position to the
+// beginning of the data. Returns 0 if the header is not usable.
+int parseHeader(FILE *fh, Header *header) {
+  Header h = {0};
+  int magic = 0;
   
   // Check if there is a magic number
   if (fgetc(fh) != 'P') {
     fprintf(stderr, "Error: Malformed input magic number. \n");
-    exit(1);
+    return 0;
   }
   
-  // Parse magic number
-  fscanf(fh, "%d ", (int *) &h.magicNumber);
+  // Parse magic number. One the format does not have is left 0, for the
+  // caller to report.
+  if (fscanf(fh, "%d ", &magic) != 1) {
+    fprintf(stderr, "Error: Malformed input magic number. \n");
+    return 0;
+  }
+  h.magicNumber = magic >= 1 && magic <= 6 ? (unsigned char) magic : 0;
   
-  skipComments(fh);
+  if (!skipComments(fh)) {
+    return 0;
+  }
   
   // Parse width
-  fscanf(fh, "%d ", &h.width);
+  if (fscanf(fh, "%u ", &h.width) != 1) {
+    fprintf(stderr, "Error: Unable to read image width.\n");
+    return 0;
+  }
   
-  skipComments(fh);
+  if (!skipComments(fh)) {
+    return 0;
+  }
   
   // Parse height
-  fscanf(fh, "%d ", &h.height);
-  
-  skipComments(fh);
+  if (fscanf(fh, "%u", &h.height) != 1) {
+    fprintf(stderr, "Error: Unable to read image height.\n");
+    return 0;
+  }
   
-  // Parse maximum color value
-  fscanf(fh, "%d", (int *) &h.maxColor);
+  // Bitmaps have no maximum color value
+  if (h.magicNumber == 1 || h.magicNumber == 4) {
+    h.maxColor = 1;
+  }
+  else {
+    fscanf(fh, " ");
+    
+    if (!skipComments(fh)) {
+      return 0;
+    }
+    
+    // Parse maximum color value
+    if (fscanf(fh, "%u", &h.maxColor) != 1) {
+      fprintf(stderr, "Error: Unable to read maximum color value.\n");
+      return 0;
+    }
+  }
   
   // Skip single whitespace character before data
   fgetc(fh);
   
+  h.channels = h.magicNumber == 3 || h.magicNumber == 6 ? 3 : 1;
+  
   // Check if any parsing encountered an error.
   if (ferror(fh) != 0) {
-     fprintf(stderr, "Error: Unable to read header.");
-     exit(1);
+     fprintf(stderr, "Error: Unable to read header.\n");
+     return 0;
+  }
+  
+  // Sizes worked out from the header later are size_t products of its
+  // fields, so the largest, the raw samples, is checked once here
+  if (h.width == 0 || h.height == 0 ||
+      !sizeFits(h.width, h.height, h.channels * (h.maxColor > 255 ? 2 : 1))) {
+     fprintf(stderr, "Error: Image size %ux%u is not supported.\n", h.width, h.height);
+     return 0;
   }
    
-  return h;
+  *header = h;
+  return 1;
 }
 
-// Reads P3 data
-void readP3(Pixel *buffer, Header h, FILE *fh) {
-  // Read RGB triples
-  for (int i = 0; i < h.width * h.height; i++) {
-     fscanf(fh, "%d %d %d", (int *) &buffer[i].red,  (int *) &buffer[i].green, (int *) &buffer[i].blue);
+
+// Returns whether width * height * bytes fits in a size_t, without
+// overflowing on the way
+int sizeFits(unsigned int width, unsigned int height, unsigned int bytes) {
+  return (unsigned long long) height * bytes <= SIZE_MAX / width;
+}
+
+// Reads P3 data, or P2 data with one channel. Returns 0 if the data is
+// invalid or too short.
+int readP3(unsigned char *buffer, Header h, FILE *fh, LoadProgress *progress) {
+  size_t rowSamples = (size_t) h.width * h.channels;
+  P3Scanner s = {buffer, 0, rowSamples * h.height, 0, 0, 0,
+                 h.maxColor, sampleScale(h.maxColor), 0};
+  char *block = malloc(P3_BLOCK_SIZE);
+  size_t len;
+  
+  if (block == NULL) {
+     fprintf(stderr, "Error: Unable to allocate read buffer.\n");
+     return 0;
+  }
+  
+  // Feed the scanner large blocks instead of parsing each sample with fscanf
+  while (s.count < s.max && !s.invalid && (len = fread(block, 1, P3_BLOCK_SIZE, fh)) > 0) {
+    scanP3Block(&s, block, block + len);
+    reportRows(progress, s.count / rowSamples);
+  }
+  finishP3Scan(&s);
+  reportRows(progress, s.count / rowSamples);
+  free(block);
+  
+  if (s.invalid) {
+     fprintf(stderr, "Error: Invalid character in data.\n");
+     return 0;
   }
   if (ferror(fh) != 0) {
-     fprintf(stderr, "Error: Unable to read data.");
-     exit(1);
+     fprintf(stderr, "Error: Unable to read data.\n");
+     return 0;
   }
+  if (s.count < s.max) {
+     fprintf(stderr, "Error: Not enough data in input file.\n");
+     return 0;
+  }
+  return 1;
 }
 
 
-// Reads P6 data
-void readP6(Pixel *buffer, Header h, FILE *fh) {
-  // Read RGB triples
-  for (int i = 0; i < h.width * h.height; i++) {
-     buffer[i].red = fgetc(fh);
-     buffer[i].green = fgetc(fh);
-     buffer[i].blue = fgetc(fh);
+// Parses the ASCII samples in [p, end) into the scanner's output. Tokens and
+// comments may span blocks, so the partial state is kept in the scanner.
+// Stops and sets s->invalid at a character that cannot be in the data.
+void scanP3Block(P3Scanner *s, const char *p, const char *end) {
+  unsigned char *out = s->out;
+  size_t count = s->count, max = s->max;
+  unsigned int maxColor = s->maxColor, scale = s->scale;
+  unsigned int value = s->value;
+  int inToken = s->inToken;
+  
+  if (s->inComment) {
+    p = memchr(p, '\n', end - p);
+    if (p == NULL) {
+      return;
+    }
+    s->inComment = 0;
   }
-  if (ferror(fh) != 0) {
-     fprintf(stderr, "Error: Unable to read data.");
-     exit(1);
+  
+  while (p < end && count < max) {
+    unsigned char c = *p++;
+    unsigned int digit = c - '0';
+    
+    if (digit < 10) {
+      // Saturate instead of overflowing on absurdly long tokens
+      if (value < 100000) {
+        value = value * 10 + digit;
+      }
+      inToken = 1;
+      continue;
+    }
+    
+    // Any other character ends the current token
+    if (inToken) {
+      out[count++] = scaleSample(value, maxColor, scale);
+      value = 0;
+      inToken = 0;
+    }
+    
+    if (c == '#') {
+      // Skip to the end of the line, which may be in a later block
+      p = memchr(p, '\n', end - p);
+      if (p == NULL) {
+        s->inComment = 1;
+        break;
+      }
+    }
+    else if (c > ' ') {
+      s->invalid = 1;
+      break;
+    }
+  }
+  
+  s->count = count;
+  s->value = value;
+  s->inToken = inToken;
+}
+
+
+// Decodes P3 data that is fully in memory on several threads. The data is
+// split into chunks at line starts, so no token or comment crosses a
+// chunk. A first pass counts the samples in each chunk, a prefix sum turns
+// the counts into output offsets, and a second pass parses every chunk
+// straight into its place in the buffer. Returns 0 if the data is invalid
+// or too short.
+int readP3Parallel(unsigned char *buffer, Header h, const unsigned char *data, size_t size,
+                    int threads, LoadProgress *progress) {
+  P3Chunk *chunks = malloc(sizeof(P3Chunk) * threads);
+  Thread *handles = malloc(sizeof(Thread) * threads);
+  const char *text = (const char *) data;
+  size_t max = (size_t) h.width * h.height * h.channels;
+  
+  if (chunks == NULL || handles == NULL) {
+    fprintf(stderr, "Error: Unable to allocate decode threads.\n");
+    free(chunks);
+    free(handles);
+    return 0;
+  }
+  
+  size_t start = 0;
+  for (int i = 0; i < threads; i++) {
+    size_t end = size;
+    if (i < threads - 1) {
+      // Move the split just past the next newline
+      size_t split = size / threads * (i + 1);
+      split = split > start ? split : start;
+      const char *newline = memchr(text + split, '\n', size - split);
+      end = newline != NULL ? (size_t) (newline - text) + 1 : size;
+    }
+    chunks[i].start = text + start;
+    chunks[i].end = text + end;
+    chunks[i].out = buffer;
+    chunks[i].max = max;
+    chunks[i].rowSamples = (size_t) h.width * h.channels;
+    chunks[i].maxColor = h.maxColor;
+    chunks[i].parsed = 0;
+    chunks[i].invalid = 0;
+    chunks[i].chunks = chunks;
+    chunks[i].count = threads;
+    chunks[i].progress = progress;
+    start = end;
+  }
+  
+  for (int pass = 0; pass < 2; pass++) {
+    ThreadFunc func = pass == 0 ? countP3Chunk : parseP3Chunk;
+    
+    // Same scheme as renderSoftware: chunks without a thread run here
+    int started = 1;
+    while (started < threads && startThread(&handles[started], func, &chunks[started])) {
+      started++;
+    }
+    for (int i = started; i < threads; i++) {
+      func(&chunks[i]);
+    }
+    func(&chunks[0]);
+    for (int i = 1; i < started; i++) {
+      joinThread(handles[i]);
+    }
+    
+    if (pass == 0) {
+      size_t offset = 0;
+      int invalid = 0;
+      for (int i = 0; i < threads; i++) {
+        invalid |= chunks[i].invalid;
+        chunks[i].offset = offset;
+        offset += chunks[i].tokens;
+        // Samples past the end of the image are ignored
+        chunks[i].wanted = chunks[i].offset >= max ? 0 : max - chunks[i].offset;
+        chunks[i].wanted = chunks[i].tokens < chunks[i].wanted ? chunks[i].tokens : chunks[i].wanted;
+      }
+      if (invalid || offset < max) {
+        fprintf(stderr, invalid ? "Error: Invalid character in data.\n" :
+                "Error: Not enough data in input file.\n");
+        free(handles);
+        free(chunks);
+        return 0;
+      }
+    }
+  }
+  
+  free(handles);
+  free(chunks);
+  return 1;
+}
+
+
+// First pass of readP3Parallel: counts the samples in a chunk
+void countP3Chunk(void *arg) {
+  P3Chunk *chunk = arg;
+  const char *p = chunk->start, *end = chunk->end;
+  size_t tokens = 0;
+  int inToken = 0;
+  TRACE_BEGIN("countP3Chunk");
+  
+  while (p < end) {
+#if defined(EZVIEW_SSE2) || defined(EZVIEW_AVX2)
+    // Blocks of only digits and whitespace are counted 16 bytes at a time
+    // by finding the digits that follow a non-digit
+    while (end - p >= 16) {
+      __m128i c = _mm_loadu_si128((const __m128i *) p);
+      __m128i x = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+      __m128i digit = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(9)), x);
+      __m128i space = _mm_cmpeq_epi8(_mm_min_epu8(c, _mm_set1_epi8(' ')), c);
+      if (_mm_movemask_epi8(_mm_or_si128(digit, space)) != 0xFFFF) {
+        break;
+      }
+      unsigned int digits = _mm_movemask_epi8(digit);
+      unsigned int starts = digits & ~((digits << 1) | inToken);
+      for (; starts != 0; starts &= starts - 1) {
+        tokens++;
+      }
+      inToken = digits >> 15;
+      p += 16;
+    }
+    if (p >= end) {
+      break;
+    }
+#endif
+    unsigned char c = *p++;
+    if ((unsigned int) (c - '0') < 10) {
+      tokens += !inToken;
+      inToken = 1;
+      continue;
+    }
+    inToken = 0;
+    if (c == '#') {
+      p = memchr(p, '\n', end - p);
+      if (p == NULL) {
+        break;
+      }
+    }
+    else if (c > ' ') {
+      chunk->invalid = 1;
+      break;
+    }
+  }
+  
+  chunk->tokens = tokens;
+  TRACE_END("countP3Chunk");
+}
+
+
+// Second pass of readP3Parallel: parses a chunk into its place in the buffer
+void parseP3Chunk(void *arg) {
+  P3Chunk *chunk = arg;
+  P3Scanner s = {chunk->out + chunk->offset, 0, chunk->wanted, 0, 0, 0,
+                 chunk->maxColor, sampleScale(chunk->maxColor), 0};
+  const char *p = chunk->start;
+  TRACE_BEGIN("parseP3Chunk");
+  
+  // Parse in blocks so progress can be shown while the chunk is decoded
+  while (p < chunk->end && s.count < s.max) {
+    const char *end = chunk->end - p > P3_BLOCK_SIZE ? p + P3_BLOCK_SIZE : chunk->end;
+    scanP3Block(&s, p, end);
+    p = end;
+    reportP3Chunk(chunk, s.count);
   }
+  finishP3Scan(&s);
+  reportP3Chunk(chunk, s.count);
+  TRACE_END("parseP3Chunk");
+}
+
+
+// Records the samples parsed in a chunk and reports the rows that are
+// complete, which end at the first chunk that is not finished
+void reportP3Chunk(P3Chunk *chunk, size_t parsed) {
+  LoadProgress *progress = chunk->progress;
+  size_t samples = 0;
+  
+  if (progress == NULL) {
+    return;
+  }
+  
+  lockMutex(&progress->mutex);
+  chunk->parsed = parsed;
+  for (int i = 0; i < chunk->count; i++) {
+    samples = chunk->chunks[i].offset + chunk->chunks[i].parsed;
+    if (chunk->chunks[i].parsed < chunk->chunks[i].wanted) {
+      break;
+    }
+  }
+  unlockMutex(&progress->mutex);
+  
+  samples = samples < chunk->max ? samples : chunk->max;
+  reportRows(progress, samples / chunk->rowSamples);
+}
+
+
+// Stores a final token that was ended by EOF rather than whitespace
+void finishP3Scan(P3Scanner *s) {
+  if (s->inToken && s->count < s->max) {
+    s->out[s->count++] = scaleSample(s->value, s->maxColor, s->scale);
+  }
+  s->value = 0;
+  s->inToken = 0;
+}
+
+
+// Reads P5 data as well. Returns 0 if the data is too short.
+int readP6(unsigned char *buffer, Header h, FILE *fh, LoadProgress *progress) {
+  size_t samples = (size_t) h.width * h.channels;
+  size_t rowBytes = h.maxColor > 255 ? samples * 2 : samples;
+  unsigned char *raw = NULL;
+  
+  // Samples that need scaling are read into a row buffer first
+  if (h.maxColor != 255) {
+    raw = malloc(rowBytes);
+    if (raw == NULL) {
+       fprintf(stderr, "Error: Unable to allocate read buffer.\n");
+       return 0;
+    }
+  }
+  
+  // Read rows of RGB triples, or of gray samples for P5
+  for (unsigned int row = 0; row < h.height; row++) {
+     unsigned char *dst = buffer + row * samples;
+     if (fread(raw != NULL ? raw : dst, 1, rowBytes, fh) != rowBytes) {
+        fprintf(stderr, "Error: Unable to read data.\n");
+        free(raw);
+        return 0;
+     }
+     if (raw != NULL) {
+        convertSamples(dst, raw, samples, h.maxColor);
+     }
+     // Report in bands rather than waking the render thread every row
+     if ((row + 1) % 64 == 0 || row + 1 == h.height) {
+        reportRows(progress, row + 1);
+     }
+  }
+  
+  free(raw);
+  return 1;
+}
+
+
+// Reads P1 data. Each 0 or 1 is a pixel, with or without whitespace
+// between them. 1 is black. Returns 0 if the data is invalid or too short.
+int readP1(unsigned char *buffer, Header h, FILE *fh, LoadProgress *progress) {
+  size_t max = (size_t) h.width * h.height, count = 0;
+  char *block = malloc(P3_BLOCK_SIZE);
+  size_t len;
+  int inComment = 0, invalid = 0;
+  
+  if (block == NULL) {
+     fprintf(stderr, "Error: Unable to allocate read buffer.\n");
+     return 0;
+  }
+  
+  while (count < max && !invalid && (len = fread(block, 1, P3_BLOCK_SIZE, fh)) > 0) {
+    for (size_t i = 0; i < len && count < max; i++) {
+      char c = block[i];
+      if (inComment) {
+        inComment = c != '\n';
+      }
+      else if (c == '0' || c == '1') {
+        buffer[count++] = c == '0' ? 255 : 0;
+      }
+      else if (c == '#') {
+        inComment = 1;
+      }
+      else if (!isspace((unsigned char) c)) {
+        invalid = 1;
+        break;
+      }
+    }
+    reportRows(progress, count / h.width);
+  }
+  free(block);
+  
+  if (invalid) {
+     fprintf(stderr, "Error: Invalid character in data.\n");
+     return 0;
+  }
+  if (ferror(fh) != 0) {
+     fprintf(stderr, "Error: Unable to read data.\n");
+     return 0;
+  }
+  if (count < max) {
+     fprintf(stderr, "Error: Not enough data in input file.\n");
+     return 0;
+  }
+  return 1;
+}
+
+
+// Reads P4 data, rows of bits padded to whole bytes. Returns 0 if the data
+// is too short.
+int readP4(unsigned char *buffer, Header h, FILE *fh, LoadProgress *progress) {
+  size_t rowBytes = ((size_t) h.width + 7) / 8;
+  unsigned char *raw = malloc(rowBytes);
+  
+  if (raw == NULL) {
+     fprintf(stderr, "Error: Unable to allocate read buffer.\n");
+     return 0;
+  }
+  
+  for (unsigned int row = 0; row < h.height; row++) {
+     if (fread(raw, 1, rowBytes, fh) != rowBytes) {
+        fprintf(stderr, "Error: Unable to read data.\n");
+        free(raw);
+        return 0;
+     }
+     unpackBits(buffer + (size_t) row * h.width, raw, h.width);
+     if ((row + 1) % 64 == 0 || row + 1 == h.height) {
+        reportRows(progress, row + 1);
+     }
+  }
+  
+  free(raw);
+  return 1;
+}
+
+
+// Expands count bits, most significant first, into bytes of 0 for set bits
+// (black) and 255 for clear ones
+void unpackBits(unsigned char *dst, const unsigned char *src, size_t count) {
+  size_t i = 0;
+  
+#if defined(EZVIEW_SSE2) || defined(EZVIEW_AVX2)
+  // Two source bytes are spread over 16 lanes, each lane tests its own bit
+  const __m128i bits = _mm_setr_epi8((char) 0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1,
+                                     (char) 0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1);
+  for (; i + 16 <= count; i += 16) {
+    __m128i v = _mm_cvtsi32_si128(src[i / 8] | (src[i / 8 + 1] << 8));
+    v = _mm_unpacklo_epi8(v, v);
+    v = _mm_unpacklo_epi16(v, v);
+    v = _mm_unpacklo_epi32(v, v);
+    v = _mm_cmpeq_epi8(_mm_and_si128(v, bits), _mm_setzero_si128());
+    _mm_storeu_si128((__m128i *) (dst + i), v);
+  }
+#endif
+  for (; i < count; i++) {
+    dst[i] = (src[i / 8] >> (7 - i % 8)) & 1 ? 0 : 255;
+  }
+}
+
+
+// Returns the fixed point factor used by scaleSample for maxColor. It is
+// 255 / maxColor in 16.16, so 255 maps to 65536 and samples pass unchanged.
+unsigned int sampleScale(unsigned int maxColor) {
+  return ((255u << 16) + maxColor / 2) / maxColor;
+}
+
+
+// Scales count raw P6 samples to 0..255. Samples are one byte when maxColor
+// is below 256 and two big-endian bytes otherwise.
+void convertSamples(unsigned char *dst, const unsigned char *src, size_t count,
+                    unsigned int maxColor) {
+  unsigned int scale = sampleScale(maxColor);
+  
+  if (maxColor > 255) {
+    convertSamples16(dst, src, count, maxColor);
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    dst[i] = scaleSample(src[i], maxColor, scale);
+  }
+}
+
+
+// Byte swaps and scales big-endian 16-bit samples to 0..255. For maxColor
+// above 255 the factor fits in 16 bits, so the SIMD versions get the exact
+// scaleSample result from the high and low halves of a 16x16 multiply.
+void convertSamples16(unsigned char *dst, const unsigned char *src, size_t count,
+                      unsigned int maxColor) {
+  unsigned int scale = sampleScale(maxColor);
+  size_t i = 0;
+  
+#if defined(EZVIEW_AVX2)
+  const __m256i bias = _mm256_set1_epi16((short) 0x8000);
+  const __m256i limit = _mm256_set1_epi16((short) (maxColor ^ 0x8000));
+  const __m256i factor = _mm256_set1_epi16((short) scale);
+  for (; i + 32 <= count; i += 32) {
+    __m256i packed[2];
+    for (int half = 0; half < 2; half++) {
+      __m256i v = _mm256_loadu_si256((const __m256i *) (src + (i + half * 16) * 2));
+      v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+      v = _mm256_min_epu16(v, _mm256_xor_si256(limit, bias));
+      __m256i hi = _mm256_mulhi_epu16(v, factor);
+      __m256i lo = _mm256_mullo_epi16(v, factor);
+      packed[half] = _mm256_add_epi16(hi, _mm256_srli_epi16(lo, 15));
+    }
+    // packus works within 128-bit lanes, so put the lanes back in order
+    __m256i bytes = _mm256_packus_epi16(packed[0], packed[1]);
+    bytes = _mm256_permute4x64_epi64(bytes, 0xD8);
+    _mm256_storeu_si256((__m256i *) (dst + i), bytes);
+  }
+#elif defined(EZVIEW_SSE2)
+  // SSE2 only has a signed 16-bit min, so the clamp is done with the sign
+  // bit flipped
+  const __m128i bias = _mm_set1_epi16((short) 0x8000);
+  const __m128i limit = _mm_set1_epi16((short) (maxColor ^ 0x8000));
+  const __m128i factor = _mm_set1_epi16((short) scale);
+  for (; i + 16 <= count; i += 16) {
+    __m128i packed[2];
+    for (int half = 0; half < 2; half++) {
+      __m128i v = _mm_loadu_si128((const __m128i *) (src + (i + half * 8) * 2));
+      v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+      v = _mm_xor_si128(_mm_min_epi16(_mm_xor_si128(v, bias), limit), bias);
+      __m128i hi = _mm_mulhi_epu16(v, factor);
+      __m128i lo = _mm_mullo_epi16(v, factor);
+      packed[half] = _mm_add_epi16(hi, _mm_srli_epi16(lo, 15));
+    }
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(packed[0], packed[1]));
+  }
+#endif
+  for (; i < count; i++) {
+    unsigned int v = (src[i * 2] << 8) | src[i * 2 + 1];
+    dst[i] = scaleSample(v, maxColor, scale);
+  }
+}
+
+
+// Maps a P6 file and returns a pointer to its pixel data, which starts at
+// offset. Returns NULL if the file cannot be mapped, is too short or its
+// samples need scaling, so the caller can fall back to readP6, which
+// reports a short file.
+const unsigned char *mapSamples(MappedFile *map, const char *path, Header h, long long offset) {
+  // Only samples already in 0..255 can be used in place
+  if ((h.magicNumber != 5 && h.magicNumber != 6) || h.maxColor != 255 || offset < 0 ||
+      !mapFile(map, path)) {
+    return NULL;
+  }
+  
+  // Validate the header before trusting the mapping's size
+  if (map->size < (size_t) offset + (size_t) h.width * h.height * h.channels) {
+    unmapFile(map);
+    return NULL;
+  }
+  
+  return map->data + offset;
+}
+
+
+// Opens an image and starts decoding it on a background thread. P5 and P6
+// files that can be mapped, and files with an up to date sidecar when
+// diskCache is set, are ready at once and need no thread. P5 and P6 files
+// may be cropped, other files ignoring the crop, and get a decimated preview read before returning when
+// asked for. Returns 0, with the error printed, if the file cannot be opened
+// or its header is not usable. Errors in the data are found by the loader
+// thread and recorded in image->progress.
+int openImage(Loader *image, const char *path, const LoadOptions *options) {
+  int threads = options->threads;
+  int diskCache = options->diskCache && !options->cropped;
+  
+  memset(image, 0, sizeof(Loader));
+  initMutex(&image->progress.mutex);
+  
+  if (!fileStamp(path, &image->sourceSize, &image->sourceTime)) {
+    return abandonImage(image);
+  }
+  if (diskCache) {
+    TRACE_BEGIN("mapDiskCache");
+    image->pixels = mapDiskCache(&image->map, path, &image->header,
+                                 image->sourceSize, image->sourceTime);
+    TRACE_END("mapDiskCache");
+    if (image->pixels != NULL) {
+      // The cached samples are 8-bit and whole, and get an overview or a
+      // preview from memory just as a mapped file does
+      Region whole = {0, 0, image->header.width, image->header.height, 1};
+      image->path = path;
+      image->threads = threads;
+      image->source = image->header;
+      image->source.maxColor = 255;
+      image->region = whole;
+      image->overview = overviewStep(image->header, options->budget);
+      unsigned int step = image->overview > 0 ? image->overview : options->preview;
+      if (step > 1) {
+        readPreview(image, step);
+      }
+      image->progress.rowsReady = image->header.height;
+      return 1;
+    }
+  }
+  image->diskCache = diskCache && image->sourceSize >= DISK_CACHE_MIN_BYTES;
+  
+  image->input = fopen(path, "rb");
+  if (image->input == NULL) {
+    return abandonImage(image);
+  }
+  
+  // Compressed files are decoded from a stream fed by a decompression thread
+  image->compression = detectCompression(image->input);
+  if (image->compression != COMPRESSION_NONE) {
+    image->input = openCompressed(image->input, path, image->compression);
+    if (image->input == NULL) {
+      return abandonImage(image);
+    }
+  }
+  
+  // Get header information from input file
+  image->path = path;
+  image->threads = threads;
+  TRACE_BEGIN("parseHeader");
+  int parsed = parseHeader(image->input, &image->header);
+  TRACE_END("parseHeader");
+  if (!parsed) {
+    return abandonImage(image);
+  }
+  image->dataOffset = tellFile(image->input);
+  
+  if (image->header.maxColor == 0 || image->header.maxColor > 65535) {
+    fprintf(stderr, "Error: Maximum color must be between 1 and 65535.\n");
+    return abandonImage(image);
+  }
+  if (image->header.magicNumber < 1 || image->header.magicNumber > 6) {
+    fprintf(stderr, "Error: Input magic number not supported.\n");
+    return abandonImage(image);
+  }
+  
+  int binary = image->header.magicNumber == 5 || image->header.magicNumber == 6;
+  Region whole = {0, 0, image->header.width, image->header.height, 1};
+  image->source = image->header;
+  image->region = whole;
+  
+  // Only the crop is loaded, and it stands for the whole image from here on.
+  // Other formats, which may be browsed among cropped files, are shown
+  // whole.
+  if (options->cropped && !binary) {
+    fprintf(stderr, "Warning: Only P5 and P6 files can be cropped, so %s is shown whole.\n",
+            path);
+    image->diskCache = options->diskCache && image->sourceSize >= DISK_CACHE_MIN_BYTES;
+  }
+  else if (options->cropped) {
+    image->region = clipRegion(options->crop, image->header);
+    if (image->region.width == 0 || image->region.height == 0) {
+      fprintf(stderr, "Error: Crop is outside the image.\n");
+      return abandonImage(image);
+    }
+    image->cropped = 1;
+    image->header.width = image->region.width;
+    image->header.height = image->region.height;
+  }
+  
+  // An image too big for the texture budget is never shown whole at full
+  // resolution, so it gets an overview that stays under its tiles, read
+  // in place of any preview
+  image->overview = overviewStep(image->header, options->budget);
+  unsigned int step = image->overview > 0 ? image->overview : options->preview;
+  
+  // P5 and P6 data is used in place from a mapping of the file when possible
+  if (binary && !image->cropped && image->compression == COMPRESSION_NONE) {
+    TRACE_BEGIN("mapSamples");
+    image->pixels = mapSamples(&image->map, path, image->header, image->dataOffset);
+    TRACE_END("mapSamples");
+    if (image->pixels != NULL) {
+      // The mapped rows still have to be uploaded, which the preview skips.
+      // The mapping was checked to hold them all.
+      if (step > 1) {
+        readPreview(image, step);
+      }
+      fclose(image->input);
+      image->input = NULL;
+      image->progress.rowsReady = image->header.height;
+      return 1;
+    }
+  }
+  
+  // Binary rows are at known offsets, so a preview costs a fraction of a
+  // full read. Compressed data can only be read in order.
+  if (binary && step > 1 && image->compression == COMPRESSION_NONE &&
+      !readPreview(image, step)) {
+    fprintf(stderr, "Error: Reading the preview of %s stopped there.\n", path);
+    return abandonImage(image);
+  }
+  
+  // Create buffer and read data from input on the loader thread. Binary
+  // files too big for memory can still be shown decimated.
+  image->buffer = malloc((size_t) image->header.width * image->header.height *
+                         image->header.channels);
+  if (image->buffer == NULL && binary && image->compression == COMPRESSION_NONE) {
+    return shrinkImage(image);
+  }
+  if (image->buffer == NULL) {
+    fprintf(stderr, "Error: Not enough memory to decode %s.\n", path);
+    return abandonImage(image);
+  }
+  image->pixels = (const unsigned char *) image->buffer;
+  
+  image->running = startThread(&image->thread, loadImage, image);
+  if (!image->running) {
+    loadImage(image);
+  }
+  return 1;
+}
+
+
+// Decodes an image opened by openImage using the appropriate function. An
+// image that cannot be decoded is marked failed in its progress, keeping the
+// rows decoded before the error.
+void loadImage(void *arg) {
+  Loader *image = arg;
+  Header h = image->header;
+  int decoded;
+  
+  TRACE_BEGIN("loadImage");
+  if (image->cropped) {
+    // Only the rows and columns of the crop are read, from a mapping when
+    // the file can be mapped
+    const unsigned char *data = NULL;
+    size_t bytes = (size_t) image->source.width * image->source.height * image->source.channels *
+                   (image->source.maxColor > 255 ? 2 : 1);
+    if (image->compression == COMPRESSION_NONE && image->dataOffset >= 0 &&
+        mapFile(&image->map, image->path) &&
+        image->map.size >= (size_t) image->dataOffset + bytes) {
+      data = image->map.data + image->dataOffset;
+    }
+    TRACE_BEGIN("readRegion");
+    decoded = readRegion(image->buffer, image->source, image->region, data, image->input,
+                         image->dataOffset, &image->progress);
+    TRACE_END("readRegion");
+    unmapFile(&image->map);
+  }
+  else if ((h.magicNumber == 2 || h.magicNumber == 3) && image->threads > 1 &&
+           image->compression == COMPRESSION_NONE && image->dataOffset >= 0 &&
+           mapFile(&image->map, image->path)) {
+    // The whole file is needed to split it between threads
+    TRACE_BEGIN("readP3Parallel");
+    decoded = readP3Parallel(image->buffer, h, image->map.data + image->dataOffset,
+                   image->map.size - image->dataOffset, image->threads, &image->progress);
+    TRACE_END("readP3Parallel");
+    unmapFile(&image->map);
+  }
+  else if (h.magicNumber == 2 || h.magicNumber == 3) {
+    TRACE_BEGIN("readP3");
+    decoded = readP3(image->buffer, h, image->input, &image->progress);
+    TRACE_END("readP3");
+  }
+  else if (h.magicNumber == 1) {
+    TRACE_BEGIN("readP1");
+    decoded = readP1(image->buffer, h, image->input, &image->progress);
+    TRACE_END("readP1");
+  }
+  else if (h.magicNumber == 4) {
+    TRACE_BEGIN("readP4");
+    decoded = readP4(image->buffer, h, image->input, &image->progress);
+    TRACE_END("readP4");
+  }
+  else {
+    TRACE_BEGIN("readP6");
+    decoded = readP6(image->buffer, h, image->input, &image->progress);
+    TRACE_END("readP6");
+  }
+  
+  fclose(image->input);
+  image->input = NULL;
+  
+  if (!decoded) {
+    fprintf(stderr, "Error: Decoding %s stopped there.\n", image->path);
+    failLoad(&image->progress);
+  }
+  // Parsing was the slow part, so keep the result for next time
+  else if (image->diskCache) {
+    TRACE_BEGIN("writeDiskCache");
+    writeDiskCache(image);
+    TRACE_END("writeDiskCache");
+  }
+  TRACE_END("loadImage");
+}
+
+
+// Reads the image's region at 1/step resolution into image->preview. Runs
+// before the loader thread starts, using image->pixels when the file is
+// mapped in place and reads from image->input otherwise. A preview that
+// cannot be allocated is skipped. Returns 0 if the file is too short.
+int readPreview(Loader *image, unsigned int step) {
+  Region r = image->region;
+  r.step = step;
+  
+  image->previewHeader = image->header;
+  image->previewHeader.width = (r.width + step - 1) / step;
+  image->previewHeader.height = (r.height + step - 1) / step;
+  image->preview = malloc((size_t) image->previewHeader.width * image->previewHeader.height *
+                          image->previewHeader.channels);
+  if (image->preview == NULL) {
+    return 1;
+  }
+  
+  TRACE_BEGIN("readPreview");
+  int read = readRegion(image->preview, image->source, r, image->pixels, image->input,
+                        image->dataOffset, NULL);
+  TRACE_END("readPreview");
+  if (!read) {
+    free(image->preview);
+    image->preview = NULL;
+    return 0;
+  }
+  
+  // The loader thread reads on from the start of the data
+  if (image->input != NULL) {
+    seekFile(image->input, image->dataOffset);
+  }
+  return 1;
+}
+
+
+// Replaces an image whose pixels cannot be allocated with the largest
+// decimated version of it that can, read at once like a preview. Returns 0
+// if not even that fits.
+int shrinkImage(Loader *image) {
+  unsigned int step = image->overview > 0 ? image->overview : 2;
+  
+  while (image->preview == NULL) {
+    if (step >= image->header.width && step >= image->header.height) {
+      fprintf(stderr, "Error: Not enough memory to show %s.\n", image->path);
+      return abandonImage(image);
+    }
+    if (!readPreview(image, step)) {
+      return abandonImage(image);
+    }
+    step *= 2;
+  }
+  
+  // The decimated pixels stand for the whole image from here on
+  fprintf(stderr, "Warning: Not enough memory for %s, so it is shown at %ux%u.\n",
+          image->path, image->previewHeader.width, image->previewHeader.height);
+  fclose(image->input);
+  image->input = NULL;
+  image->header = image->previewHeader;
+  image->buffer = image->preview;
+  image->pixels = image->buffer;
+  image->preview = NULL;
+  image->overview = 0;
+  image->diskCache = 0;
+  image->progress.rowsReady = image->header.height;
+  return 1;
+}
+
+
+// Returns the decimation of the overview for an image whose tiles, with
+// their mip levels, cannot all be resident in budget. The overview takes at
+// most 1/OVERVIEW_SHARE of it. Returns 0 if the image fits, or budget is 0.
+unsigned int overviewStep(Header h, size_t budget) {
+  unsigned long long texel = h.channels == 1 ? 1 : 4;
+  unsigned int step = 2;
+  
+  if (budget == 0 || (unsigned long long) h.width * h.height * texel * 4 / 3 <= budget) {
+    return 0;
+  }
+  while ((unsigned long long) ((h.width + step - 1) / step) * ((h.height + step - 1) / step) *
+         texel * 4 / 3 > budget / OVERVIEW_SHARE) {
+    step++;
+  }
+  return step;
+}
+
+
+// Decimates the decoded pixels of an image into image->preview, for the
+// overview of one that could not be read decimated from its file. A
+// preview that cannot be allocated leaves the image without an overview.
+void readOverview(Loader *image) {
+  Header h = image->header;
+  Region whole = {0, 0, h.width, h.height, image->overview};
+  
+  image->previewHeader = h;
+  image->previewHeader.width = (h.width + whole.step - 1) / whole.step;
+  image->previewHeader.height = (h.height + whole.step - 1) / whole.step;
+  image->preview = malloc((size_t) image->previewHeader.width * image->previewHeader.height *
+                          h.channels);
+  if (image->preview == NULL) {
+    image->overview = 0;
+    return;
+  }
+  
+  // Decoded samples are 8-bit whatever the file held
+  h.maxColor = 255;
+  TRACE_BEGIN("readOverview");
+  readRegion(image->preview, h, whole, image->pixels, NULL, 0, NULL);
+  TRACE_END("readOverview");
+}
+
+
+// Reads a region of P5 or P6 samples into dst, keeping every step-th row
+// and column and scaling samples to 0..255. Rows come from data, the mapped
+// samples of the whole image, or from fh by seeking to each one when data
+// is NULL. Untouched rows are never read. Returns 0 if the file is too short.
+int readRegion(unsigned char *dst, Header h, Region r, const unsigned char *data, FILE *fh,
+                long long dataOffset, LoadProgress *progress) {
+  size_t sampleBytes = h.maxColor > 255 ? 2 : 1;
+  size_t pixelBytes = h.channels * sampleBytes;
+  size_t rowBytes = (size_t) h.width * pixelBytes;
+  unsigned int width = (r.width + r.step - 1) / r.step;
+  unsigned int height = (r.height + r.step - 1) / r.step;
+  size_t span = ((size_t) (width - 1) * r.step + 1) * pixelBytes;
+  size_t samples = (size_t) width * h.channels;
+  unsigned int scale = sampleScale(h.maxColor);
+  unsigned char *raw = NULL;
+  
+  if (data == NULL) {
+    raw = malloc(span);
+    if (raw == NULL) {
+      fprintf(stderr, "Error: Unable to allocate read buffer.\n");
+      return 0;
+    }
+  }
+  
+  for (unsigned int row = 0; row < height; row++) {
+    // Offsets past 4 GB are only seeked to, as such files cannot be mapped
+    // in 32-bit builds
+    unsigned long long offset = (unsigned long long) (r.y + row * r.step) * rowBytes +
+                                (unsigned long long) r.x * pixelBytes;
+    const unsigned char *src = data != NULL ? data + offset : raw;
+    unsigned char *out = dst + row * samples;
+    
+    if (data == NULL && (seekFile(fh, dataOffset + (long long) offset) != 0 ||
+                         fread(raw, 1, span, fh) != span)) {
+      fprintf(stderr, "Error: Not enough data in input file.\n");
+      free(raw);
+      return 0;
+    }
+    
+    if (r.step == 1 && h.maxColor == 255) {
+      memcpy(out, src, samples);
+    }
+    else if (r.step == 1) {
+      convertSamples(out, src, samples, h.maxColor);
+    }
+    else {
+      // Decimated pixels are picked out one at a time
+      for (unsigned int col = 0; col < width; col++) {
+        const unsigned char *p = src + (size_t) col * r.step * pixelBytes;
+        for (unsigned int c = 0; c < h.channels; c++) {
+          unsigned int value = sampleBytes == 2 ? (p[c * 2] << 8) | p[c * 2 + 1] : p[c];
+          *out++ = h.maxColor == 255 ? value : scaleSample(value, h.maxColor, scale);
+        }
+      }
+    }
+    
+    if ((row + 1) % 64 == 0 || row + 1 == height) {
+      reportRows(progress, row + 1);
+    }
+  }
+  
+  free(raw);
+  return 1;
+}
+
+
+// Clips a region to the bounds of an image. The result may be empty.
+Region clipRegion(Region r, Header h) {
+  r.x = r.x < h.width ? r.x : h.width;
+  r.y = r.y < h.height ? r.y : h.height;
+  r.width = r.width < h.width - r.x ? r.width : h.width - r.x;
+  r.height = r.height < h.height - r.y ? r.height : h.height - r.y;
+  return r;
+}
+
+
+// Maps the sidecar of an input if it was written for the input as it is
+// now, and fills in the input's header. Returns the pixels, or NULL if
+// there is no usable sidecar.
+const unsigned char *mapDiskCache(MappedFile *map, const char *path, Header *h,
+                                  unsigned long long sourceSize, long long sourceTime) {
+  char *cachePath = diskCachePath(path, DISK_CACHE_SUFFIX);
+  if (cachePath == NULL || !mapFile(map, cachePath)) {
+    free(cachePath);
+    return NULL;
+  }
+  free(cachePath);
+  
+  const DiskCacheHeader *c = (const DiskCacheHeader *) map->data;
+  if (map->size < sizeof(DiskCacheHeader) ||
+      memcmp(c->magic, DISK_CACHE_MAGIC, sizeof(c->magic)) != 0 ||
+      c->byteOrder != 0x01020304 || c->sourceSize != sourceSize ||
+      c->sourceTime != sourceTime || c->width == 0 || c->height == 0 ||
+      c->dataOffset < sizeof(DiskCacheHeader) || c->dataOffset > map->size ||
+      (c->magicNumber < 1 || c->magicNumber > 6) ||
+      (map->size - c->dataOffset) / (c->magicNumber == 3 || c->magicNumber == 6 ? 3 : 1) /
+      c->width < c->height) {
+    unmapFile(map);
+    return NULL;
+  }
+  
+  h->magicNumber = (unsigned char) c->magicNumber;
+  h->width = c->width;
+  h->height = c->height;
+  h->maxColor = c->maxColor;
+  h->channels = h->magicNumber == 3 || h->magicNumber == 6 ? 3 : 1;
+  return map->data + c->dataOffset;
+}
+
+
+// Writes the decoded pixels of an image to its sidecar. The file is put
+// together under another name and renamed, so a reader never sees part of
+// one. Failures only mean the next open decodes again.
+void writeDiskCache(Loader *image) {
+  char *cachePath = diskCachePath(image->path, DISK_CACHE_SUFFIX);
+  char *tempPath = diskCachePath(image->path, DISK_CACHE_SUFFIX ".tmp");
+  FILE *fh = tempPath != NULL ? fopen(tempPath, "wb") : NULL;
+  if (cachePath == NULL || fh == NULL) {
+    free(cachePath);
+    free(tempPath);
+    return;
+  }
+  
+  DiskCacheHeader c;
+  memset(&c, 0, sizeof(c));
+  memcpy(c.magic, DISK_CACHE_MAGIC, sizeof(c.magic));
+  c.byteOrder = 0x01020304;
+  c.magicNumber = image->header.magicNumber;
+  c.width = image->header.width;
+  c.height = image->header.height;
+  c.maxColor = image->header.maxColor;
+  c.sourceSize = image->sourceSize;
+  c.sourceTime = image->sourceTime;
+  c.dataOffset = DISK_CACHE_ALIGN;
+  
+  static const unsigned char padding[DISK_CACHE_ALIGN];
+  size_t bytes = (size_t) image->header.width * image->header.height * image->header.channels;
+  int written = fwrite(&c, sizeof(c), 1, fh) == 1 &&
+                fwrite(padding, DISK_CACHE_ALIGN - sizeof(c), 1, fh) == 1 &&
+                fwrite(image->buffer, 1, bytes, fh) == bytes;
+  written = fclose(fh) == 0 && written;
+  
+#ifdef _WIN32
+  written = written && MoveFileExA(tempPath, cachePath, MOVEFILE_REPLACE_EXISTING);
+#else
+  written = written && rename(tempPath, cachePath) == 0;
+#endif
+  if (!written) {
+    remove(tempPath);
+  }
+  free(cachePath);
+  free(tempPath);
+}
+
+
+// Returns path with suffix appended, or NULL if out of memory
+char *diskCachePath(const char *path, const char *suffix) {
+  char *joined = malloc(strlen(path) + strlen(suffix) + 1);
+  if (joined != NULL) {
+    strcpy(joined, path);
+    strcat(joined, suffix);
+  }
+  return joined;
+}
+
+
+// Gets the size and modification time of a file. Returns 0 if it does not
+// exist.
+int fileStamp(const char *path, unsigned long long *size, long long *time) {
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA info;
+  if (!GetFileAttributesExA(path, GetFileExInfoStandard, &info)) {
+    return 0;
+  }
+  *size = ((unsigned long long) info.nFileSizeHigh << 32) | info.nFileSizeLow;
+  *time = ((long long) info.ftLastWriteTime.dwHighDateTime << 32) |
+          info.ftLastWriteTime.dwLowDateTime;
+#else
+  struct stat info;
+  if (stat(path, &info) != 0) {
+    return 0;
+  }
+  *size = (unsigned long long) info.st_size;
+  // Nanoseconds catch a rewrite within the same second
+#ifdef __APPLE__
+  *time = (long long) info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+  *time = (long long) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+#endif
+  return 1;
+}
+
+
+// Tells compressed input apart by its first bytes, then rewinds the file
+int detectCompression(FILE *fh) {
+  unsigned char magic[4] = {0};
+  size_t count = fread(magic, 1, 4, fh);
+  
+  rewind(fh);
+  if (count >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    return COMPRESSION_GZIP;
+  }
+  if (count == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+      magic[3] == 0xfd) {
+    return COMPRESSION_ZSTD;
+  }
+  return COMPRESSION_NONE;
+}
+
+
+// stdio calls these to read a stream from openCompressed
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+static int readCookie(void *cookie, char *buf, int size) {
+  return (int) readInflater(cookie, buf, (size_t) size);
+}
+
+static fpos_t seekCookie(void *cookie, fpos_t offset, int whence) {
+  long long position = offset;
+  return seekInflater(cookie, &position, whence) == 0 ? (fpos_t) position : -1;
+}
+
+static int closeCookie(void *cookie) {
+  return closeInflater(cookie);
+}
+#elif !defined(_WIN32)
+static ssize_t readCookie(void *cookie, char *buf, size_t size) {
+  return (ssize_t) readInflater(cookie, buf, size);
+}
+
+static int seekCookie(void *cookie, off64_t *offset, int whence) {
+  long long position = *offset;
+  if (seekInflater(cookie, &position, whence) != 0) {
+    return -1;
+  }
+  *offset = position;
+  return 0;
+}
+
+static int closeCookie(void *cookie) {
+  return closeInflater(cookie);
+}
+#endif
+
+
+// Starts decompressing source on a thread and returns a stream of the
+// decompressed bytes, which takes ownership of source. Returns NULL, with
+// source closed, if this build cannot read the format or decompression
+// cannot be started.
+FILE *openCompressed(FILE *source, const char *path, int compression) {
+  int supported = 0;
+#ifdef EZVIEW_ZLIB
+  supported |= compression == COMPRESSION_GZIP;
+#endif
+#ifdef EZVIEW_ZSTD
+  supported |= compression == COMPRESSION_ZSTD;
+#endif
+  if (!supported) {
+    fprintf(stderr, "Error: %s is %s compressed, which this build cannot read.\n", path,
+            compression == COMPRESSION_GZIP ? "gzip" : "zstd");
+    fclose(source);
+    return NULL;
+  }
+  
+  Inflater *s = calloc(1, sizeof(Inflater));
+  int allocated = s != NULL && (s->input = malloc(STREAM_INPUT_SIZE)) != NULL;
+  for (int i = 0; allocated && i < STREAM_BLOCKS; i++) {
+    allocated = (s->blocks[i] = malloc(STREAM_BLOCK_SIZE)) != NULL;
+  }
+  if (!allocated) {
+    fprintf(stderr, "Error: Unable to allocate decompression buffers.\n");
+    if (s != NULL) {
+      free(s->input);
+      for (int i = 0; i < STREAM_BLOCKS; i++) {
+        free(s->blocks[i]);
+      }
+    }
+    free(s);
+    fclose(source);
+    return NULL;
+  }
+  s->source = source;
+  s->path = path;
+  s->compression = compression;
+  initMutex(&s->mutex);
+  initCond(&s->changed);
+  
+  int started = 0;
+#ifdef EZVIEW_ZLIB
+  if (compression == COMPRESSION_GZIP) {
+    // 32 lets zlib take gzip or zlib headers
+    started = inflateInit2(&s->zlib, 15 + 32) == Z_OK;
+  }
+#endif
+#ifdef EZVIEW_ZSTD
+  if (compression == COMPRESSION_ZSTD) {
+    s->zstd = ZSTD_createDStream();
+    started = s->zstd != NULL && !ZSTD_isError(ZSTD_initDStream(s->zstd));
+  }
+#endif
+  
+  FILE *stream = NULL;
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+  stream = funopen(s, readCookie, NULL, seekCookie, closeCookie);
+#elif !defined(_WIN32)
+  cookie_io_functions_t io = {readCookie, NULL, seekCookie, closeCookie};
+  stream = fopencookie(s, "rb", io);
+#endif
+  if (!started || stream == NULL) {
+    fprintf(stderr, "Error: Unable to start decompressing %s.\n", path);
+    if (stream != NULL) {
+      fclose(stream);
+    }
+    else {
+      closeInflater(s);
+    }
+    return NULL;
+  }
+  
+  // Without a thread, blocks are decompressed as the decoder asks for them
+  s->running = startThread(&s->thread, inflateInput, s);
+  return stream;
+}
+
+
+// Keeps the ring of an Inflater full until the data ends or the decoder
+// closes the stream
+void inflateInput(void *arg) {
+  Inflater *s = arg;
+  int more = 1;
+  
+  while (more) {
+    lockMutex(&s->mutex);
+    while (s->filled - s->drained >= STREAM_BLOCKS - 1 && !s->closing) {
+      waitCond(&s->changed, &s->mutex);
+    }
+    more = !s->closing;
+    unlockMutex(&s->mutex);
+    
+    if (more) {
+      more = produceBlock(s);
+    }
+  }
+}
+
+
+// Decompresses the next block into a free slot of the ring. Returns 0 once
+// the data has ended or turned out to be corrupt.
+int produceBlock(Inflater *s) {
+  unsigned int slot = s->filled % STREAM_BLOCKS;
+  size_t length;
+  
+  TRACE_BEGIN("inflateBlock");
+  int status = inflateBlock(s, s->blocks[slot], &length);
+  TRACE_END("inflateBlock");
+  
+  lockMutex(&s->mutex);
+  s->lengths[slot] = length;
+  if (length > 0) {
+    s->filled++;
+  }
+  s->finished = status <= 0;
+  s->failed = status < 0;
+  broadcastCond(&s->changed);
+  unlockMutex(&s->mutex);
+  return status > 0;
+}
+
+
+// Decompresses up to a block of data into out, setting length to the bytes
+// written. Returns 0 once the input is used up, and -1 if it is corrupt or
+// cut short, with the bytes before the error in out.
+int inflateBlock(Inflater *s, unsigned char *out, size_t *length) {
+  *length = 0;
+  while (*length < STREAM_BLOCK_SIZE) {
+    int failed = 0;
+    
+    if (s->inputStart == s->inputEnd) {
+      s->inputStart = 0;
+      s->inputEnd = fread(s->input, 1, STREAM_INPUT_SIZE, s->source);
+      if (s->inputEnd == 0 && !s->ended) {
+        fprintf(stderr, "Error: Compressed data in %s is cut short.\n", s->path);
+        return -1;
+      }
+      if (s->inputEnd == 0) {
+        return 0;
+      }
+    }
+    
+#ifdef EZVIEW_ZLIB
+    if (s->compression == COMPRESSION_GZIP) {
+      // Concatenated gzip members each start a new stream
+      if (s->ended && inflateReset(&s->zlib) != Z_OK) {
+        failed = 1;
+      }
+      s->zlib.next_in = s->input + s->inputStart;
+      s->zlib.avail_in = (uInt) (s->inputEnd - s->inputStart);
+      s->zlib.next_out = out + *length;
+      s->zlib.avail_out = (uInt) (STREAM_BLOCK_SIZE - *length);
+      int status = inflate(&s->zlib, Z_NO_FLUSH);
+      failed |= status != Z_OK && status != Z_STREAM_END;
+      s->ended = status == Z_STREAM_END;
+      s->inputStart = s->inputEnd - s->zlib.avail_in;
+      *length = STREAM_BLOCK_SIZE - s->zlib.avail_out;
+    }
+#endif
+#ifdef EZVIEW_ZSTD
+    if (s->compression == COMPRESSION_ZSTD) {
+      ZSTD_inBuffer in = {s->input, s->inputEnd, s->inputStart};
+      ZSTD_outBuffer output = {out, STREAM_BLOCK_SIZE, *length};
+      size_t status = ZSTD_decompressStream(s->zstd, &output, &in);
+      failed = ZSTD_isError(status);
+      
+      // A frame is complete once nothing of it is left to flush
+      s->ended = status == 0;
+      s->inputStart = in.pos;
+      *length = output.pos;
+    }
+#endif
+    
+    if (failed) {
+      fprintf(stderr, "Error: Compressed data in %s is corrupt.\n", s->path);
+      return -1;
+    }
+  }
+  return 1;
+}
+
+
+// Copies up to size decompressed bytes to buf, or skips them when buf is
+// NULL, waiting for blocks as needed. Returns less than size only at the
+// end of the data, and -1 once the bytes before corrupt data are used up,
+// which stdio reports as a read error.
+long long readInflater(Inflater *s, char *buf, size_t size) {
+  size_t done = 0;
+  
+  while (done < size) {
+    lockMutex(&s->mutex);
+    while (s->running && s->drained == s->filled && !s->finished) {
+      waitCond(&s->changed, &s->mutex);
+    }
+    int empty = s->drained == s->filled;
+    int finished = s->finished;
+    int failed = s->failed;
+    unlockMutex(&s->mutex);
+    
+    if (empty && finished && failed && done == 0) {
+      return -1;
+    }
+    if (empty && finished) {
+      break;
+    }
+    if (empty) {
+      produceBlock(s);
+      continue;
+    }
+    
+    // The oldest block is the reader's until it is used up
+    unsigned int slot = s->drained % STREAM_BLOCKS;
+    size_t count = s->lengths[slot] - s->offset;
+    if (count > size - done) {
+      count = size - done;
+    }
+    if (buf != NULL) {
+      memcpy(buf + done, s->blocks[slot] + s->offset, count);
+    }
+    s->offset += count;
+    s->position += count;
+    done += count;
+    
+    if (s->offset == s->lengths[slot]) {
+      s->offset = 0;
+      lockMutex(&s->mutex);
+      s->drained++;
+      broadcastCond(&s->changed);
+      unlockMutex(&s->mutex);
+    }
+  }
+  return (long long) done;
+}
+
+
+// Moves the read position of a stream from openCompressed to offset, then
+// sets offset to the new position. Moving forward decompresses and drops
+// the bytes in between. Moving back only works within blocks that have not
+// been reused.
+int seekInflater(Inflater *s, long long *offset, int whence) {
+  long long target = *offset;
+  
+  if (whence == SEEK_CUR) {
+    target += (long long) s->position;
+  }
+  else if (whence != SEEK_SET) {
+    return -1;
+  }
+  
+  // A block is still whole until the slot it was in is filled again
+  lockMutex(&s->mutex);
+  while (target < (long long) (s->position - s->offset) && s->drained > 0 &&
+         s->drained - 1 + STREAM_BLOCKS > s->filled) {
+    s->position -= s->offset;
+    s->drained--;
+    s->offset = s->lengths[s->drained % STREAM_BLOCKS];
+  }
+  unlockMutex(&s->mutex);
+  if (target < (long long) (s->position - s->offset)) {
+    return -1;
+  }
+  
+  if (target <= (long long) s->position) {
+    s->offset -= (size_t) (s->position - target);
+    s->position = target;
+  }
+  else {
+    size_t skip = (size_t) (target - (long long) s->position);
+    if (readInflater(s, NULL, skip) != (long long) skip) {
+      return -1;
+    }
+  }
+  *offset = (long long) s->position;
+  return 0;
+}
+
+
+// Stops the decompression thread and frees a stream from openCompressed,
+// along with the file it read. Called by fclose.
+int closeInflater(Inflater *s) {
+  lockMutex(&s->mutex);
+  s->closing = 1;
+  broadcastCond(&s->changed);
+  unlockMutex(&s->mutex);
+  if (s->running) {
+    joinThread(s->thread);
+  }
+  
+#ifdef EZVIEW_ZLIB
+  if (s->compression == COMPRESSION_GZIP) {
+    inflateEnd(&s->zlib);
+  }
+#endif
+#ifdef EZVIEW_ZSTD
+  if (s->compression == COMPRESSION_ZSTD) {
+    ZSTD_freeDStream(s->zstd);
+  }
+#endif
+  fclose(s->source);
+  free(s->input);
+  for (int i = 0; i < STREAM_BLOCKS; i++) {
+    free(s->blocks[i]);
+  }
+  free(s);
+  return 0;
+}
+
+
+// Blocks until the whole image is decoded
+void waitForImage(Loader *image) {
+  if (image->running) {
+    TRACE_BEGIN("waitForImage");
+    joinThread(image->thread);
+    image->running = 0;
+    TRACE_END("waitForImage");
+  }
+}
+
+
+// Releases an image and its decoding resources. The loader can only be
+// opened again after this.
+void closeImage(Loader *image) {
+  freePixels(image);
+  destroyMutex(&image->progress.mutex);
+}
+
+
+// Releases the pixels of an image once decoded, keeping its progress
+void freePixels(Loader *image) {
+  waitForImage(image);
+  free(image->buffer);
+  image->buffer = NULL;
+  free(image->preview);
+  image->preview = NULL;
+  unmapFile(&image->map);
+  image->pixels = NULL;
+}
+
+
+// Closes an image that openImage could not finish opening and returns 0,
+// for openImage to return
+int abandonImage(Loader *image) {
+  if (image->input != NULL) {
+    fclose(image->input);
+    image->input = NULL;
+  }
+  closeImage(image);
+  return 0;
+}
+
+
+// Records that the top rows of an image are decoded and asks for a redraw
+void reportRows(LoadProgress *progress, unsigned int rows) {
+  int notify;
+  
+  if (progress == NULL) {
+    return;
+  }
+  
+  lockMutex(&progress->mutex);
+  if (rows > progress->rowsReady) {
+    progress->rowsReady = rows;
+  }
+  notify = progress->notify;
+  unlockMutex(&progress->mutex);
+  
+  if (notify) {
+    raiseFlag(&needs_redraw);
+    glfwPostEmptyEvent();
+  }
+}
+
+
+// Returns the number of rows at the top of an image that are decoded
+unsigned int readyRows(LoadProgress *progress) {
+  lockMutex(&progress->mutex);
+  unsigned int rows = progress->rowsReady;
+  unlockMutex(&progress->mutex);
+  return rows;
+}
+
+
+// Records that decoding stopped on bad data, so the rows ready are all
+// there will be, and asks for a redraw
+void failLoad(LoadProgress *progress) {
+  lockMutex(&progress->mutex);
+  progress->failed = 1;
+  int notify = progress->notify;
+  unlockMutex(&progress->mutex);
+  
+  if (notify) {
+    raiseFlag(&needs_redraw);
+    glfwPostEmptyEvent();
+  }
+}
+
+
+// Returns whether decoding stopped on bad data
+int loadFailed(LoadProgress *progress) {
+  lockMutex(&progress->mutex);
+  int failed = progress->failed;
+  unlockMutex(&progress->mutex);
+  return failed;
+}
+
+
+// Maps the whole file read-only. Returns 0 on failure, which includes files
+// larger than the address space of 32-bit builds.
+int mapFile(MappedFile *map, const char *path) {
+#ifdef _WIN32
+  LARGE_INTEGER size;
+  map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                          FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (map->file == INVALID_HANDLE_VALUE) {
+    return 0;
+  }
+  if (!GetFileSizeEx(map->file, &size) || size.QuadPart == 0 ||
+      (unsigned long long) size.QuadPart > SIZE_MAX) {
+    CloseHandle(map->file);
+    return 0;
+  }
+  map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (map->mapping == NULL) {
+    CloseHandle(map->file);
+    return 0;
+  }
+  map->data = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (map->data == NULL) {
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+    return 0;
+  }
+  map->size = (size_t) size.QuadPart;
+#else
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  // Pipes and other special files cannot be mapped
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+      (unsigned long long) st.st_size > SIZE_MAX) {
+    close(fd);
+    return 0;
+  }
+  void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 0;
+  }
+#ifdef MADV_SEQUENTIAL
+  // The texture upload reads the mapping front to back
+  madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL);
+#endif
+  map->data = data;
+  map->size = (size_t) st.st_size;
+#endif
+  return 1;
+}
+
+
+// Releases a mapping made by mapFile
+void unmapFile(MappedFile *map) {
+  if (map->data == NULL) {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(map->data);
+  CloseHandle(map->mapping);
+  CloseHandle(map->file);
+#else
+  munmap((void *) map->data, map->size);
+#endif
+  map->data = NULL;
+  map->size = 0;
+}
+
+
+// Moves to a byte offset from the start of a file, which may be past the
+// 2 GB that fseek reaches where long has 32 bits. Returns 0 on success.
+int seekFile(FILE *fh, long long offset) {
+#ifdef _WIN32
+  return _fseeki64(fh, offset, SEEK_SET);
+#else
+  return fseeko(fh, (off_t) offset, SEEK_SET);
+#endif
+}
+
+
+// Returns the position in a file as ftell does, past 2 GB as well
+long long tellFile(FILE *fh) {
+#ifdef _WIN32
+  return _ftelli64(fh);
+#else
+  return (long long) ftello(fh);
+#endif
+}
+
+
+// Splits the image into tiles no larger than GL_MAX_TEXTURE_SIZE and creates
+// the vertex buffer holding one quad per tile. Tiles are uploaded from pixels
+// when they first become visible, as GL_LUMINANCE with one channel and
+// GL_RGB with three. Each texture holds a border of TILE_BORDER pixels around
+// its quad, so the filters read the same texels across a seam as within a
+// tile, and the texture coordinates of the quad leave the border out.
+void initTiles(TileSet *t, unsigned int width, unsigned int height, unsigned int channels,
+               const unsigned char *pixels, size_t budget) {
+  GLint maxSize;
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+  
+  t->width = width;
+  t->height = height;
+  t->channels = channels;
+  t->pixels = pixels;
+  t->rowsReady = 0;
+  t->staging = NULL;
+  t->residentBytes = 0;
+  t->budget = budget;
+  t->frame = 0;
+  t->uploadLimit = 0;
+  t->pending = 0;
+  t->streaming = 0;
+  t->live = 0;
+  t->compression = 0;
+  t->threads = 1;
+  t->blockBytes = 0;
+  memset(&t->encoded, 0, sizeof(EncodeStats));
+  
+  // GLES2 only allows mip levels on non-power-of-two textures with this
+  const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+  t->npotMipmaps = extensions != NULL && strstr(extensions, "GL_OES_texture_npot") != NULL;
+  
+  // Images that fit are kept in a single texture
+  if (width <= (unsigned int) maxSize && height <= (unsigned int) maxSize &&
+      tileBytes(width, height, channels) <= budget) {
+    t->tileSize = width > height ? width : height;
+  }
+  else {
+    t->tileSize = TILE_SIZE < maxSize ? TILE_SIZE : maxSize;
+  }
+  t->border = t->tileSize >= width && t->tileSize >= height ? 0 : TILE_BORDER;
+  unsigned int step = t->tileSize - 2 * t->border;
+  t->columns = (width + step - 1) / step;
+  t->rows = (height + step - 1) / step;
+  
+  size_t count = (size_t) t->columns * t->rows;
+  t->tiles = calloc(count, sizeof(Tile));
+  Vertex *quads = malloc(sizeof(Vertex) * 6 * count);
+  if (t->tiles == NULL || quads == NULL) {
+    fprintf(stderr, "Error: Unable to allocate tiles.");
+    exit(1);
+  }
+  
+  for (size_t i = 0; i < count; i++) {
+    Tile *tile = &t->tiles[i];
+    unsigned int x = (i % t->columns) * step, y = (i / t->columns) * step;
+    unsigned int w = width - x < step ? width - x : step;
+    unsigned int h = height - y < step ? height - y : step;
+    tile->x = (int) x - (int) t->border;
+    tile->y = (int) y - (int) t->border;
+    tile->width = w + 2 * t->border;
+    tile->height = h + 2 * t->border;
+    
+    // The image spans (-1, -1) to (1, 1) with its first row at the top
+    tile->left = -1 + 2.0f * x / width;
+    tile->right = -1 + 2.0f * (x + w) / width;
+    tile->top = 1 - 2.0f * y / height;
+    tile->bottom = 1 - 2.0f * (y + h) / height;
+    
+    // Shape each quad after the full-image one in vertexes
+    for (int k = 0; k < 6; k++) {
+      quads[i * 6 + k].Position[0] = vertexes[k].Position[0] < 0 ? tile->left : tile->right;
+      quads[i * 6 + k].Position[1] = vertexes[k].Position[1] > 0 ? tile->top : tile->bottom;
+      quads[i * 6 + k].TexCoord[0] = (t->border + vertexes[k].TexCoord[0] * w) / tile->width;
+      quads[i * 6 + k].TexCoord[1] = (t->border + vertexes[k].TexCoord[1] * h) / tile->height;
+    }
+  }
+  
+  glGenBuffers(1, &t->vertexBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, t->vertexBuffer);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * 6 * count, quads, GL_STATIC_DRAW);
+  free(quads);
+}
+
+
+// Draws the tiles that intersect the viewport under mvp, uploading any that
+// are not resident and fit in the budget once tiles not visible are
+// evicted. At most uploadLimit tiles are uploaded when it is set, and
+// pending counts the visible tiles still left to upload.
+void drawTiles(TileSet *t, mat4x4 mvp) {
+  size_t count = (size_t) t->columns * t->rows;
+  unsigned int uploads = 0;
+  
+  t->frame++;
+  t->pending = 0;
+  
+  // Visible tiles are marked first, so making room for one never evicts
+  // another
+  for (size_t i = 0; i < count; i++) {
+    if (tileVisible(&t->tiles[i], mvp)) {
+      t->tiles[i].lastUsed = t->frame;
+    }
+  }
+  
+  for (size_t i = 0; i < count; i++) {
+    Tile *tile = &t->tiles[i];
+    if (tile->lastUsed != t->frame) {
+      continue;
+    }
+    if (tile->rowsUploaded < tile->height && (t->uploadLimit == 0 || uploads < t->uploadLimit)) {
+      // A tile that does not fit in the budget is left out, and any
+      // overview under it shows instead. A tile set always gets one.
+      if (tile->texture == 0 && readyTileRows(t, tile) > 0 &&
+          !evictTiles(t, uploadBytes(t, tile)) && t->residentBytes > 0) {
+        continue;
+      }
+      uploadTile(t, tile);
+      uploads++;
+    }
+    if (tile->rowsUploaded < tile->height) {
+      t->pending++;
+    }
+    if (tile->texture == 0) {
+      continue;
+    }
+    glBindTexture(GL_TEXTURE_2D, tile->texture);
+    // The filters read pairs of texels in one GL_LINEAR fetch. Minified
+    // tiles with mip levels already blend, the others need it set too.
+    GLint texels = sample_filter == FILTER_NEAREST ? GL_NEAREST : GL_LINEAR;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, texels);
+    if (!t->streaming && (tile->rowsUploaded < tile->height || !hasMipmaps(t, tile))) {
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, texels);
+    }
+    glUniform2f(tile_size_location, tile->width, tile->height);
+    glDrawArrays(GL_TRIANGLES, i * 6, 6);
+  }
+  
+  evictTiles(t, 0);
+}
+
+
+// Makes the quads of a tile set the source of the vertex attributes
+void bindTiles(TileSet *t, GLint positionLocation, GLint texCoordLocation) {
+  glBindBuffer(GL_ARRAY_BUFFER, t->vertexBuffer);
+  glVertexAttribPointer(positionLocation, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) 0);
+  glVertexAttribPointer(texCoordLocation, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                        (void*) (sizeof(float) * 2));
+}
+
+
+// Checks whether the bounding box of a tile's quad in clip space overlaps
+// the viewport.
+int tileVisible(Tile *tile, mat4x4 mvp) {
+  float corners[4][2] = {
+    {tile->left, tile->top}, {tile->right, tile->top},
+    {tile->right, tile->bottom}, {tile->left, tile->bottom}
+  };
+  float minX = 1e30f, maxX = -1e30f, minY = 1e30f, maxY = -1e30f;
+  
+  for (int i = 0; i < 4; i++) {
+    vec4 v = {corners[i][0], corners[i][1], 0.f, 1.f};
+    vec4 r;
+    mat4x4_mul_vec4(r, mvp, v);
+    float x = r[0] / r[3], y = r[1] / r[3];
+    minX = x < minX ? x : minX;
+    maxX = x > maxX ? x : maxX;
+    minY = y < minY ? y : minY;
+    maxY = y > maxY ? y : maxY;
+  }
+  
+  return maxX >= -1 && minX <= 1 && maxY >= -1 && minY <= 1;
+}
+
+
+// Uploads the rows of a tile decoded since its last upload, creating its
+// texture first if needed. Mip levels are added once the whole tile is in.
+void uploadTile(TileSet *t, Tile *tile) {
+  unsigned int rows = readyTileRows(t, tile);
+  if (rows <= tile->rowsUploaded) {
+    return;
+  }
+  TRACE_BEGIN("uploadTile");
+  
+  // Compressed tiles replace whatever rows were shown once all are decoded
+  if (t->compression != 0 && rows == tile->height) {
+    uploadCompressed(t, tile);
+    TRACE_END("uploadTile");
+    return;
+  }
+  
+  // Rows of packed samples are not 4-byte aligned
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  GLenum format = t->channels == 1 ? GL_LUMINANCE : GL_RGB;
+  
+  if (tile->texture == 0) {
+    createTexture(t, tile);
+    if (rows == tile->height) {
+      glTexImage2D(GL_TEXTURE_2D, 0, format, tile->width, tile->height, 0, format,
+                   GL_UNSIGNED_BYTE, tileRows(t, tile, 0, rows));
+    }
+    else {
+      // Allocate the whole tile and fill in what has been decoded so far
+      glTexImage2D(GL_TEXTURE_2D, 0, format, tile->width, tile->height, 0, format,
+                   GL_UNSIGNED_BYTE, NULL);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tile->width, rows, format,
+                      GL_UNSIGNED_BYTE, tileRows(t, tile, 0, rows));
+    }
+    tile->bytes = tileBytes(tile->width, tile->height, t->channels);
+    t->residentBytes += tile->bytes;
+  }
+  else {
+    glBindTexture(GL_TEXTURE_2D, tile->texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, tile->rowsUploaded, tile->width,
+                    rows - tile->rowsUploaded, format, GL_UNSIGNED_BYTE,
+                    tileRows(t, tile, tile->rowsUploaded, rows - tile->rowsUploaded));
+  }
+  tile->rowsUploaded = rows;
+  
+  if (rows == tile->height && hasMipmaps(t, tile)) {
+    TRACE_BEGIN("uploadMipmaps");
+    // Live tile sets keep the levels, to update them when rows change
+    if (t->live && tile->levels == NULL) {
+      tile->levels = malloc(mipBytes(tile->width, tile->height, t->channels));
+    }
+    uploadMipmaps(tileRows(t, tile, 0, rows), tile->width, tile->height, t->channels,
+                  tile->levels);
+    TRACE_END("uploadMipmaps");
+    // Minified views blend between mip levels instead of skipping texels
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    // The levels below the base add a third
+    t->residentBytes += tile->bytes / 3;
+    tile->bytes += tile->bytes / 3;
+  }
+  TRACE_END("uploadTile");
+}
+
+
+// Returns the rows at the top of a tile that are decoded. The border past
+// the last row of the image is ready once that row is.
+unsigned int readyTileRows(TileSet *t, Tile *tile) {
+  long long rows = (long long) t->rowsReady - tile->y;
+  if (t->rowsReady >= t->height || rows >= tile->height) {
+    return tile->height;
+  }
+  return rows > 0 ? (unsigned int) rows : 0;
+}
+
+
+// Returns count rows of a tile starting at row first as packed RGB. Rows
+// and columns of its border past the edges of the image repeat the edge.
+const unsigned char *tileRows(TileSet *t, Tile *tile, unsigned int first, unsigned int count) {
+  unsigned int channels = t->channels;
+  size_t stride = (size_t) t->width * channels;
+  size_t rowBytes = (size_t) tile->width * channels;
+  
+  if (t->border == 0 && tile->width == t->width) {
+    return t->pixels + (tile->y + first) * stride;
+  }
+  
+  // GLES2 has no GL_UNPACK_ROW_LENGTH, so rows narrower than the image
+  // are gathered into the staging buffer first
+  if (t->staging == NULL) {
+    t->staging = malloc((size_t) t->tileSize * t->tileSize * t->channels);
+    if (t->staging == NULL) {
+      fprintf(stderr, "Error: Unable to allocate staging buffer.");
+      exit(1);
+    }
+  }
+  unsigned int before = tile->x < 0 ? (unsigned int) -tile->x : 0;
+  unsigned int after = tile->x + tile->width > t->width ? tile->x + tile->width - t->width : 0;
+  for (unsigned int row = 0; row < count; row++) {
+    long long y = (long long) tile->y + first + row;
+    y = y < 0 ? 0 : y < t->height ? y : t->height - 1;
+    const unsigned char *src = t->pixels + y * stride;
+    unsigned char *dst = t->staging + row * rowBytes;
+    memcpy(dst + (size_t) before * channels, src + (size_t) (tile->x + before) * channels,
+           (size_t) (tile->width - before - after) * channels);
+    for (unsigned int k = 0; k < before; k++) {
+      memcpy(dst + (size_t) k * channels, src, channels);
+    }
+    for (unsigned int k = tile->width - after; k < tile->width; k++) {
+      memcpy(dst + (size_t) k * channels, src + stride - channels, channels);
+    }
+  }
+  return t->staging;
+}
+
+
+// Whether a tile gets mip levels once all its rows are uploaded
+int hasMipmaps(TileSet *t, Tile *tile) {
+  int pot = (tile->width & (tile->width - 1)) == 0 && (tile->height & (tile->height - 1)) == 0;
+  return (pot || t->npotMipmaps) && !t->streaming;
+}
+
+
+// Returns the size of the mip levels below a base level, all together
+size_t mipBytes(unsigned int width, unsigned int height, unsigned int channels) {
+  size_t bytes = 0;
+  
+  while (width > 1 || height > 1) {
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+    bytes += (size_t) width * height * channels;
+  }
+  return bytes;
+}
+
+
+// Builds the mip levels below a packed luminance or RGB base level on the
+// CPU and uploads them to the bound texture. When keep is given, the levels
+// are left in it one after another, as refreshMipmaps expects.
+void uploadMipmaps(const unsigned char *base, unsigned int width, unsigned int height,
+                   unsigned int channels, unsigned char *keep) {
+  GLenum format = channels == 1 ? GL_LUMINANCE : GL_RGB;
+  unsigned int w1 = width > 1 ? width / 2 : 1;
+  unsigned int h1 = height > 1 ? height / 2 : 1;
+  unsigned int w2 = w1 > 1 ? w1 / 2 : 1;
+  unsigned int h2 = h1 > 1 ? h1 / 2 : 1;
+  
+  // Otherwise levels alternate between two buffers sized for levels 1 and 2
+  unsigned char *scratch = NULL;
+  unsigned char *levels[2] = {NULL, NULL};
+  if (keep == NULL) {
+    scratch = malloc(((size_t) w1 * h1 + (size_t) w2 * h2) * channels);
+    if (scratch == NULL) {
+      fprintf(stderr, "Error: Unable to allocate mipmap buffer.");
+      exit(1);
+    }
+    levels[0] = scratch;
+    levels[1] = scratch + (size_t) w1 * h1 * channels;
+  }
+  const unsigned char *src = base;
+  
+  for (int level = 1; width > 1 || height > 1; level++) {
+    unsigned char *dst = keep != NULL ? keep : levels[(level - 1) % 2];
+    downsample2x2(dst, src, width, height, channels);
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+    glTexImage2D(GL_TEXTURE_2D, level, format, width, height, 0, format,
+                 GL_UNSIGNED_BYTE, dst);
+    src = dst;
+    if (keep != NULL) {
+      keep += (size_t) width * height * channels;
+    }
+  }
+  
+  free(scratch);
+}
+
+
+// Rebuilds the rows of each mip level below the base that rows first to
+// first + count - 1 of a tile are averaged into, and uploads them to the
+// bound texture. The levels kept by a live tile set supply the rows next to
+// them. Without those, every level is built again.
+void refreshMipmaps(TileSet *t, Tile *tile, unsigned int first, unsigned int count) {
+  GLenum format = t->channels == 1 ? GL_LUMINANCE : GL_RGB;
+  unsigned int channels = t->channels;
+  unsigned int width = tile->width, height = tile->height;
+  unsigned int top = first, bottom = first + count;
+  const unsigned char *src = NULL;
+  unsigned char *dst = tile->levels;
+  
+  if (tile->levels == NULL) {
+    uploadMipmaps(tileRows(t, tile, 0, tile->height), tile->width, tile->height, channels, NULL);
+    return;
+  }
+  
+  for (int level = 1; width > 1 || height > 1; level++) {
+    unsigned int w1 = width > 1 ? width / 2 : 1;
+    unsigned int h1 = height > 1 ? height / 2 : 1;
+    
+    // Each row averages two of the level above, whose odd last row is
+    // dropped, so a change there goes no further
+    unsigned int a = top / 2, b = (bottom + 1) / 2;
+    b = b < h1 ? b : h1;
+    if (a >= b) {
+      break;
+    }
+    unsigned int rows = height > 1 ? 2 * (b - a) : 1;
+    const unsigned char *above = src != NULL ? src + (size_t) 2 * a * width * channels :
+                                               tileRows(t, tile, 2 * a, rows);
+    unsigned char *out = dst + (size_t) a * w1 * channels;
+    downsample2x2(out, above, width, rows, channels);
+    glTexSubImage2D(GL_TEXTURE_2D, level, 0, a, w1, b - a, format, GL_UNSIGNED_BYTE, out);
+    
+    src = dst;
+    dst += (size_t) w1 * h1 * channels;
+    width = w1;
+    height = h1;
+    top = a;
+    bottom = b;
+  }
+}
+
+
+// Averages 2x2 blocks of a packed image with the given number of channels
+// into dst, which is half the size (at least 1) in each direction. As in
+// glGenerateMipmap, an odd last row or column is dropped.
+void downsample2x2(unsigned char *dst, const unsigned char *src,
+                   unsigned int width, unsigned int height, int channels) {
+  unsigned int dstWidth = width > 1 ? width / 2 : 1;
+  unsigned int dstHeight = height > 1 ? height / 2 : 1;
+  size_t rowBytes = (size_t) width * channels;
+  // A single column is paired with itself
+  size_t pairOffset = width > 1 ? channels : 0;
+#if defined(EZVIEW_SSE2) || defined(EZVIEW_AVX2)
+  unsigned char *means = malloc(rowBytes);
+  
+  if (means == NULL) {
+    fprintf(stderr, "Error: Unable to allocate mipmap buffer.");
+    exit(1);
+  }
+#endif
+  
+  for (unsigned int y = 0; y < dstHeight; y++) {
+    const unsigned char *row0 = src + (size_t) y * 2 * rowBytes;
+    // A single row is paired with itself
+    const unsigned char *row1 = height > 1 ? row0 + rowBytes : row0;
+    unsigned char *out = dst + (size_t) y * dstWidth * channels;
+    
+#if defined(EZVIEW_SSE2) || defined(EZVIEW_AVX2)
+    // The mean of the block starting at every byte is worked out with SIMD,
+    // then those that start a block of the output are picked out
+    meanBlocks(means, row0, row1, rowBytes - pairOffset, pairOffset);
+    if (channels == 1) {
+      pickEven(out, means, dstWidth);
+      continue;
+    }
+    unsigned int x = 0;
+    if (channels == 3) {
+      // Four bytes are copied at a time, the last being overwritten by the
+      // next pixel
+      for (; x + 1 < dstWidth; x++) {
+        memcpy(out, means + (size_t) x * 6, 4);
+        out += 3;
+      }
+    }
+    for (; x < dstWidth; x++) {
+      memcpy(out, means + (size_t) x * 2 * channels, channels);
+      out += channels;
+    }
+#else
+    for (unsigned int x = 0; x < dstWidth; x++) {
+      size_t i = (size_t) x * 2 * channels;
+      for (int c = 0; c < channels; c++, i++) {
+        *out++ = (row0[i] + row0[i + pairOffset] + row1[i] + row1[i + pairOffset] + 2) >> 2;
+      }
+    }
+#endif
+  }
+  
+#if defined(EZVIEW_SSE2) || defined(EZVIEW_AVX2)
+  free(means);
+#endif
+}
+
+
+#if defined(EZVIEW_SSE2) || defined(EZVIEW_AVX2)
+// Sets means[i] to the rounded mean of a[i], a[i + offset], b[i] and
+// b[i + offset] for count bytes
+void meanBlocks(unsigned char *means, const unsigned char *a, const unsigned char *b,
+                size_t count, size_t offset) {
+  size_t i = 0;
+#if defined(EZVIEW_AVX2)
+  const __m256i two = _mm256_set1_epi16(2);
+  for (; i + 16 <= count; i += 16) {
+    __m256i sum = _mm256_add_epi16(
+        _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (a + i))),
+                         _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (b + i)))),
+        _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (a + i + offset))),
+                         _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (b + i + offset)))));
+    sum = _mm256_srli_epi16(_mm256_add_epi16(sum, two), 2);
+    // Packing works within each 128-bit lane
+    __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    _mm_storeu_si128((__m128i *) (means + i), packed);
+  }
+#elif defined(EZVIEW_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i two = _mm_set1_epi16(2);
+  for (; i + 16 <= count; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+    __m128i vc = _mm_loadu_si128((const __m128i *) (a + i + offset));
+    __m128i vd = _mm_loadu_si128((const __m128i *) (b + i + offset));
+    __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero)),
+                               _mm_add_epi16(_mm_unpacklo_epi8(vc, zero), _mm_unpacklo_epi8(vd, zero)));
+    __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero)),
+                               _mm_add_epi16(_mm_unpackhi_epi8(vc, zero), _mm_unpackhi_epi8(vd, zero)));
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+    _mm_storeu_si128((__m128i *) (means + i), _mm_packus_epi16(lo, hi));
+  }
+#endif
+  for (; i < count; i++) {
+    means[i] = (a[i] + a[i + offset] + b[i] + b[i + offset] + 2) >> 2;
+  }
+}
+
+
+// Copies the bytes at even offsets of src to dst
+void pickEven(unsigned char *dst, const unsigned char *src, size_t count) {
+  size_t i = 0;
+  const __m128i low = _mm_set1_epi16(0x00FF);
+  for (; i + 16 <= count; i += 16) {
+    __m128i v0 = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + i * 2)), low);
+    __m128i v1 = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + i * 2 + 16)), low);
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(v0, v1));
+  }
+  for (; i < count; i++) {
+    dst[i] = src[i * 2];
+  }
+}
+#endif
+
+
+// Tells whether two runs of bytes are the same, a vector at a time
+int sameBytes(const unsigned char *a, const unsigned char *b, size_t count) {
+  size_t i = 0;
+#if defined(EZVIEW_AVX2)
+  for (; i + 32 <= count; i += 32) {
+    __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + i)),
+                                   _mm256_loadu_si256((const __m256i *) (b + i)));
+    if ((unsigned int) _mm256_movemask_epi8(eq) != 0xffffffffu) {
+      return 0;
+    }
+  }
+#elif defined(EZVIEW_SSE2)
+  for (; i + 16 <= count; i += 16) {
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i)),
+                                _mm_loadu_si128((const __m128i *) (b + i)));
+    if (_mm_movemask_epi8(eq) != 0xffff) {
+      return 0;
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    if (a[i] != b[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+// Creates the texture of a tile and binds it, with nothing in it yet
+void createTexture(TileSet *t, Tile *tile) {
+  glGenTextures(1, &tile->texture);
+  glBindTexture(GL_TEXTURE_2D, tile->texture);
+  // Streamed frames get no mip levels to blend between when minified
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, t->streaming ? GL_LINEAR : GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  // Non-power-of-two textures must clamp in GLES2
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+
+// Uploads a fully decoded tile as ETC1 with glCompressedTexImage2D, along
+// with its mip levels, encoding it first unless its blocks are kept from an
+// earlier upload. Any rows uploaded uncompressed are replaced.
+void uploadCompressed(TileSet *t, Tile *tile) {
+  int mipmaps = hasMipmaps(t, tile);
+  if (tile->blocks == NULL) {
+    encodeTile(t, tile, mipmaps);
+  }
+  
+  if (tile->texture == 0) {
+    createTexture(t, tile);
+  }
+  else {
+    glBindTexture(GL_TEXTURE_2D, tile->texture);
+    t->residentBytes -= tile->bytes;
+  }
+  
+  unsigned int width = tile->width, height = tile->height;
+  size_t offset = 0;
+  for (int level = 0; ; level++) {
+    size_t bytes = etc1Bytes(width, height);
+    glCompressedTexImage2D(GL_TEXTURE_2D, level, GL_ETC1_RGB8_OES, width, height, 0,
+                           (GLsizei) bytes, tile->blocks + offset);
+    offset += bytes;
+    if (!mipmaps || (width == 1 && height == 1)) {
+      break;
+    }
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+  if (mipmaps) {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  }
+  tile->bytes = offset;
+  t->residentBytes += offset;
+  tile->rowsUploaded = tile->height;
+  
+  // A single tile gives up its source once uploaded, see main, so there is
+  // nothing to bring back and its blocks are not worth keeping
+  if (t->columns * t->rows == 1) {
+    free(tile->blocks);
+    tile->blocks = NULL;
+    t->blockBytes -= offset;
+  }
+}
+
+
+// Encodes a tile, and its mip levels if it gets them, to ETC1 blocks held in
+// tile->blocks one level after another. The levels are built as by
+// uploadMipmaps.
+void encodeTile(TileSet *t, Tile *tile, int mipmaps) {
+  unsigned int width = tile->width, height = tile->height, channels = t->channels;
+  unsigned int w1 = width > 1 ? width / 2 : 1;
+  unsigned int h1 = height > 1 ? height / 2 : 1;
+  unsigned int w2 = w1 > 1 ? w1 / 2 : 1;
+  unsigned int h2 = h1 > 1 ? h1 / 2 : 1;
+  double started = nowSeconds();
+  TRACE_BEGIN("encodeTile");
+  
+  size_t total = etc1Bytes(width, height);
+  for (unsigned int w = width, h = height; mipmaps && (w > 1 || h > 1); ) {
+    w = w > 1 ? w / 2 : 1;
+    h = h > 1 ? h / 2 : 1;
+    total += etc1Bytes(w, h);
+  }
+  tile->blocks = malloc(total);
+  unsigned char *scratch = mipmaps ? malloc(((size_t) w1 * h1 + (size_t) w2 * h2) * channels) :
+                                     NULL;
+  if (tile->blocks == NULL || (mipmaps && scratch == NULL)) {
+    fprintf(stderr, "Error: Unable to allocate ETC1 blocks.");
+    exit(1);
+  }
+  unsigned char *levels[2] = {scratch, scratch + (size_t) w1 * h1 * channels};
+  
+  // Only the base level counts towards the PSNR, which is what is seen at
+  // full size
+  const unsigned char *src = tileRows(t, tile, 0, height);
+  unsigned char *out = tile->blocks;
+  t->encoded.error += encodeLevel(out, src, width, height, channels, t->compression, t->threads);
+  t->encoded.samples += (unsigned long long) width * height * 3;
+  t->encoded.pixels += (unsigned long long) width * height;
+  out += etc1Bytes(width, height);
+  
+  for (int level = 1; mipmaps && (width > 1 || height > 1); level++) {
+    unsigned char *dst = levels[(level - 1) % 2];
+    downsample2x2(dst, src, width, height, channels);
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+    encodeLevel(out, dst, width, height, channels, t->compression, t->threads);
+    t->encoded.pixels += (unsigned long long) width * height;
+    out += etc1Bytes(width, height);
+    src = dst;
+  }
+  
+  free(scratch);
+  t->blockBytes += total;
+  t->encoded.tiles++;
+  t->encoded.seconds += nowSeconds() - started;
+  TRACE_END("encodeTile");
+}
+
+
+// Returns the size of an image of the given size as ETC1 blocks
+size_t etc1Bytes(unsigned int width, unsigned int height) {
+  return (size_t) ((width + ETC1_BLOCK - 1) / ETC1_BLOCK) *
+         ((height + ETC1_BLOCK - 1) / ETC1_BLOCK) * ETC1_BLOCK_BYTES;
+}
+
+
+// Encodes packed luminance or RGB pixels to ETC1 blocks in out, with the
+// rows of blocks split across threads. Blocks are independent, so each
+// thread writes its own. Returns the squared error of the whole level.
+double encodeLevel(unsigned char *out, const unsigned char *pixels, unsigned int width,
+                   unsigned int height, unsigned int channels, int effort, int threads) {
+  unsigned int blockRows = (height + ETC1_BLOCK - 1) / ETC1_BLOCK;
+  size_t blocks = (size_t) blockRows * ((width + ETC1_BLOCK - 1) / ETC1_BLOCK);
+  
+  threads = blocks < ETC1_THREAD_BLOCKS ? 1 : threads;
+  threads = (unsigned int) threads < blockRows ? threads : (int) blockRows;
+  Etc1Job *jobs = malloc(sizeof(Etc1Job) * threads);
+  Thread *handles = malloc(sizeof(Thread) * threads);
+  if (jobs == NULL || handles == NULL) {
+    fprintf(stderr, "Error: Unable to allocate encoder threads.");
+    exit(1);
+  }
+  for (int i = 0; i < threads; i++) {
+    jobs[i].out = out;
+    jobs[i].pixels = pixels;
+    jobs[i].width = width;
+    jobs[i].height = height;
+    jobs[i].channels = channels;
+    jobs[i].firstRow = (unsigned int) ((unsigned long long) blockRows * i / threads);
+    jobs[i].lastRow = (unsigned int) ((unsigned long long) blockRows * (i + 1) / threads);
+    jobs[i].effort = effort;
+    jobs[i].error = 0;
+  }
+  
+  int started = 1;
+  while (started < threads && startThread(&handles[started], encodeBlocks, &jobs[started])) {
+    started++;
+  }
+  for (int i = started; i < threads; i++) {
+    encodeBlocks(&jobs[i]);
+  }
+  encodeBlocks(&jobs[0]);
+  for (int i = 1; i < started; i++) {
+    joinThread(handles[i]);
+  }
+  
+  double error = 0;
+  for (int i = 0; i < threads; i++) {
+    error += jobs[i].error;
+  }
+  free(handles);
+  free(jobs);
+  return error;
+}
+
+
+// Encodes the rows of blocks of one Etc1Job. Blocks over the right and
+// bottom edges repeat the last column and row, which are left out of the
+// error.
+void encodeBlocks(void *arg) {
+  Etc1Job *job = arg;
+  unsigned int columns = (job->width + ETC1_BLOCK - 1) / ETC1_BLOCK;
+  unsigned int channels = job->channels;
+  size_t stride = (size_t) job->width * channels;
+  unsigned char block[16][3];
+  TRACE_BEGIN("encodeBlocks");
+  
+  for (unsigned int row = job->firstRow; row < job->lastRow; row++) {
+    for (unsigned int column = 0; column < columns; column++) {
+      unsigned int valid = 0;
+      for (unsigned int i = 0; i < 16; i++) {
+        unsigned int x = column * ETC1_BLOCK + i % 4, y = row * ETC1_BLOCK + i / 4;
+        valid |= (x < job->width && y < job->height) << i;
+        x = x < job->width ? x : job->width - 1;
+        y = y < job->height ? y : job->height - 1;
+        
+        // Luminance is spread over all three, like GL_LUMINANCE
+        const unsigned char *p = job->pixels + y * stride + (size_t) x * channels;
+        block[i][0] = p[0];
+        block[i][1] = p[channels == 3 ? 1 : 0];
+        block[i][2] = p[channels == 3 ? 2 : 0];
+      }
+      unsigned char *out = job->out + ((size_t) row * columns + column) * ETC1_BLOCK_BYTES;
+      job->error += encodeBlock(out, block, valid, job->effort);
+    }
+  }
+  TRACE_END("encodeBlocks");
+}
+
+
+// Encodes 4 by 4 RGB pixels, by index y * 4 + x, as an ETC1 block. Both
+// ways of splitting the block in halves are tried, each in differential mode
+// with 5-bit base colors close enough to each other and in individual mode
+// with 4-bit ones. Only pixels whose bit is set in valid count. Returns the
+// squared error of the block chosen.
+unsigned int encodeBlock(unsigned char *out, unsigned char block[16][3], unsigned int valid,
+                         int effort) {
+  unsigned long long best = 0;
+  unsigned int bestError = 0xffffffffu;
+  
+  for (int flip = 0; flip < 2; flip++) {
+    // Average of each half, left and right, or top and bottom when flipped
+    int sums[2][3] = {{0, 0, 0}, {0, 0, 0}};
+    for (int i = 0; i < 16; i++) {
+      int half = flip ? i / 8 : i % 4 / 2;
+      for (int c = 0; c < 3; c++) {
+        sums[half][c] += block[i][c];
+      }
+    }
+    
+    // With ETC1_FAST, individual mode is only tried when the halves are
+    // too far apart for differential mode
+    int paired = 0;
+    for (int diff = 1; diff >= 0 && !(paired && effort != ETC1_BEST); diff--) {
+      int levels = diff ? 31 : 15;
+      
+      // Candidate base colors for each half. The nearest one, and with
+      // ETC1_BEST the other seven that round each channel up or down.
+      Etc1Fit fits[2][8];
+      int counts[2] = {0, 0};
+      for (int half = 0; half < 2; half++) {
+        int low[3], high[3];
+        for (int c = 0; c < 3; c++) {
+          float value = sums[half][c] / 8.0f * levels / 255;
+          low[c] = (int) value;
+          high[c] = low[c] < levels ? low[c] + 1 : levels;
+          if (effort != ETC1_BEST) {
+            low[c] = high[c] = (int) (value + 0.5f);
+          }
+        }
+        for (int k = 0; k < 8; k++) {
+          // Channels that round only one way give no other candidates
+          if (((k & 1) && high[0] == low[0]) || ((k & 2) && high[1] == low[1]) ||
+              ((k & 4) && high[2] == low[2])) {
+            continue;
+          }
+          int base[3] = {k & 1 ? high[0] : low[0], k & 2 ? high[1] : low[1],
+                         k & 4 ? high[2] : low[2]};
+          fitHalf(&fits[half][counts[half]++], block, valid, flip, half, base, diff,
+                  effort == ETC1_BEST);
+        }
+      }
+      
+      // The pair with the least error, as long as the second base color is
+      // within the 3-bit offset of the first in differential mode
+      for (int a = 0; a < counts[0]; a++) {
+        for (int b = 0; b < counts[1]; b++) {
+          Etc1Fit *first = &fits[0][a], *second = &fits[1][b];
+          int offsets[3];
+          int fits3 = 1;
+          for (int c = 0; c < 3; c++) {
+            offsets[c] = second->base[c] - first->base[c];
+            fits3 = fits3 && offsets[c] >= -4 && offsets[c] <= 3;
+          }
+          unsigned int error = first->error + second->error;
+          if (diff && !fits3) {
+            continue;
+          }
+          paired = 1;
+          if (error >= bestError) {
+            continue;
+          }
+          
+          unsigned long long word = 0;
+          for (int c = 0; c < 3; c++) {
+            int shift = 59 - 8 * c;
+            if (diff) {
+              word |= (unsigned long long) first->base[c] << shift;
+              word |= (unsigned long long) (offsets[c] & 7) << (shift - 3);
+            }
+            else {
+              word |= (unsigned long long) first->base[c] << (shift + 1);
+              word |= (unsigned long long) second->base[c] << (shift - 3);
+            }
+          }
+          word |= (unsigned long long) first->table << 37;
+          word |= (unsigned long long) second->table << 34;
+          word |= (unsigned long long) diff << 33;
+          word |= (unsigned long long) flip << 32;
+          
+          // Selector bits go in column order, high bits in the upper half
+          for (int i = 0; i < 16; i++) {
+            int half = flip ? i / 8 : i % 4 / 2;
+            int selector = fits[half][half ? b : a].selectors[i];
+            int bit = (i % 4) * 4 + i / 4;
+            word |= (unsigned long long) (selector >> 1) << (bit + 16);
+            word |= (unsigned long long) (selector & 1) << bit;
+          }
+          best = word;
+          bestError = error;
+        }
+      }
+    }
+  }
+  
+  // Blocks are stored big-endian
+  for (int i = 0; i < ETC1_BLOCK_BYTES; i++) {
+    out[i] = (unsigned char) (best >> (56 - 8 * i));
+  }
+  return bestError;
+}
+
+
+// Finds the modifier table and selectors that best fit a half of a block to
+// a base color of 4 or 5 bits. Exhaustively, every modifier of every table
+// is tried on each pixel. Otherwise only the one nearest to how far the
+// pixel is from the base color, leaving out clamping, is.
+void fitHalf(Etc1Fit *fit, unsigned char block[16][3], unsigned int valid, int flip, int half,
+             const int *base, int diff, int exhaustive) {
+  int color[3];
+  for (int c = 0; c < 3; c++) {
+    color[c] = diff ? (base[c] << 3) | (base[c] >> 2) : (base[c] << 4) | base[c];
+    fit->base[c] = base[c];
+  }
+  fit->error = 0xffffffffu;
+  
+  // The pixels that count, and how much brighter than the base each is
+  int pixels[8], offsets[8], count = 0;
+  for (int i = 0; i < 16; i++) {
+    if ((flip ? i / 8 : i % 4 / 2) == half && (valid >> i & 1)) {
+      offsets[count] = block[i][0] + block[i][1] + block[i][2] - color[0] - color[1] - color[2];
+      pixels[count++] = i;
+    }
+  }
+  
+  for (int table = 0; table < 8; table++) {
+    int small = etc1_modifiers[table][0], large = etc1_modifiers[table][1];
+    int modifiers[4] = {small, large, -small, -large};
+    unsigned char selectors[16] = {0};
+    unsigned int error = 0;
+    
+    for (int k = 0; k < count && error < fit->error; k++) {
+      int i = pixels[k];
+      int first = 0, last = 3;
+      if (!exhaustive) {
+        int magnitude = offsets[k] < 0 ? -offsets[k] : offsets[k];
+        first = last = (offsets[k] < 0 ? 2 : 0) + (2 * magnitude > 3 * (small + large));
+      }
+      unsigned int least = 0xffffffffu;
+      for (int s = first; s <= last; s++) {
+        unsigned int e = 0;
+        for (int c = 0; c < 3; c++) {
+          int v = color[c] + modifiers[s];
+          v = v < 0 ? 0 : (v > 255 ? 255 : v);
+          e += (v - block[i][c]) * (v - block[i][c]);
+        }
+        if (e < least) {
+          least = e;
+          selectors[i] = (unsigned char) s;
+        }
+      }
+      error += least;
+    }
+    
+    if (error < fit->error) {
+      fit->error = error;
+      fit->table = table;
+      memcpy(fit->selectors, selectors, sizeof(selectors));
+    }
+  }
+}
+
+
+// Prints the throughput and quality of the ETC1 encoding of a tile set
+void writeEncodeStats(FILE *fh, const char *path, const EncodeStats *stats) {
+  fprintf(fh, "Encoded %u tiles of %s to ETC1: %.1f Mpixels in %.1f ms (%.1f Mpixels/s), "
+          "PSNR %.2f dB\n", stats->tiles, path, stats->pixels / 1e6, stats->seconds * 1000,
+          stats->seconds > 0 ? stats->pixels / 1e6 / stats->seconds : 0, encodePsnr(stats));
+  fflush(fh);
+}
+
+
+// Returns the peak signal-to-noise ratio of the base levels encoded, in dB,
+// or 99 for a lossless encoding
+double encodePsnr(const EncodeStats *stats) {
+  return stats->error > 0 ? 10 * log10(255.0 * 255 * stats->samples / stats->error) : 99;
+}
+
+
+// Deletes the least recently drawn tiles until the resident tiles, and
+// room bytes more, fit in the budget. Tiles drawn this frame are never
+// evicted. Returns whether they fit.
+int evictTiles(TileSet *t, size_t room) {
+  size_t count = (size_t) t->columns * t->rows;
+  
+  // Without a source there is no way to bring a tile back
+  if (t->pixels == NULL) {
+    return t->residentBytes + room <= t->budget;
+  }
+  
+  while (t->residentBytes + room > t->budget) {
+    Tile *oldest = NULL;
+    for (size_t i = 0; i < count; i++) {
+      Tile *tile = &t->tiles[i];
+      if (tile->texture != 0 && tile->lastUsed < t->frame &&
+          (oldest == NULL || tile->lastUsed < oldest->lastUsed)) {
+        oldest = tile;
+      }
+    }
+    if (oldest == NULL) {
+      break;
+    }
+    glDeleteTextures(1, &oldest->texture);
+    oldest->texture = 0;
+    oldest->rowsUploaded = 0;
+    free(oldest->levels);
+    oldest->levels = NULL;
+    t->residentBytes -= oldest->bytes;
+  }
+  return t->residentBytes + room <= t->budget;
+}
+
+
+// Estimates the texture memory used by a tile. Drivers usually pad GL_RGB
+// texels to 4 bytes, while GL_LUMINANCE texels take one.
+size_t tileBytes(unsigned int width, unsigned int height, unsigned int channels) {
+  return (size_t) width * height * (channels == 1 ? 1 : 4);
+}
+
+
+// Estimates the texture memory a tile will use once uploaded whole, with
+// its mip levels
+size_t uploadBytes(TileSet *t, Tile *tile) {
+  size_t bytes = t->compression != 0 ? etc1Bytes(tile->width, tile->height) :
+                 tileBytes(tile->width, tile->height, t->channels);
+  return hasMipmaps(t, tile) ? bytes + bytes / 3 : bytes;
+}
+
+
+// Deletes the textures and buffers of a tile set
+void freeTiles(TileSet *t) {
+  size_t count = (size_t) t->columns * t->rows;
+  
+  for (size_t i = 0; i < count; i++) {
+    if (t->tiles[i].texture != 0) {
+      glDeleteTextures(1, &t->tiles[i].texture);
+    }
+    free(t->tiles[i].levels);
+    free(t->tiles[i].blocks);
+  }
+  glDeleteBuffers(1, &t->vertexBuffer);
+  free(t->tiles);
+  free(t->staging);
+  t->tiles = NULL;
+  t->staging = NULL;
+  t->residentBytes = 0;
+  t->blockBytes = 0;
+}
+
+
+// Starts decoding the files as a sequence played at rate frames per second,
+// on up to workers threads. header is that of the first file, which every
+// frame has to match. Two frames must fit in the texture budget.
+void startPlayer(Player *p, char **paths, int count, const LoadOptions *options, Header header,
+                 double rate, int workers, size_t budget) {
+  memset(p, 0, sizeof(Player));
+  p->paths = paths;
+  p->count = count;
+  p->header = header;
+  p->rate = rate;
+  p->shown = -1;
+  
+  // The workers decode whole frames side by side instead of splitting one,
+  // and leave no sidecar for each frame
+  p->options = *options;
+  p->options.threads = 1;
+  p->options.preview = 1;
+  p->options.diskCache = 0;
+  
+  // Frames stay resident from upload until they are replaced
+  if (tileBytes(header.width, header.height, header.channels) > budget / 2) {
+    fprintf(stderr, "Error: Two frames need more texture memory than --budget.\n");
+    exit(1);
+  }
+  for (int i = 0; i < 2; i++) {
+    initTiles(&p->tiles[i], header.width, header.height, header.channels, NULL, budget / 2);
+    p->tiles[i].streaming = 1;
+  }
+  
+  p->bad = calloc(count, 1);
+  if (p->bad == NULL) {
+    fprintf(stderr, "Error: Unable to allocate memory.\n");
+    exit(1);
+  }
+  
+  initMutex(&p->mutex);
+  initCond(&p->changed);
+  workers = workers < PLAY_FRAMES / 2 ? workers : PLAY_FRAMES / 2;
+  while (p->workerCount < workers &&
+         startThread(&p->workers[p->workerCount], decodeFrames, p)) {
+    p->workerCount++;
+  }
+  if (p->workerCount == 0) {
+    fprintf(stderr, "Error: Unable to start decoding frames.\n");
+    exit(1);
+  }
+}
+
+
+// Decodes frames in sequence order into free slots of the ring, until the
+// player stops. A file that cannot be decoded, or whose size differs from
+// the first, is passed over as a skipped frame. It is reported in the first
+// loop and not read again in later ones. Once every file has been passed
+// over, decoding stops.
+void decodeFrames(void *arg) {
+  Player *p = arg;
+  
+  lockMutex(&p->mutex);
+  for (;;) {
+    while (!p->stopping && p->decoded - p->released >= PLAY_FRAMES) {
+      waitCond(&p->changed, &p->mutex);
+    }
+    if (p->stopping || (p->decoded >= p->count && p->badFiles == p->count)) {
+      break;
+    }
+    long long position = p->decoded++;
+    PlayFrame *frame = &p->frames[position % PLAY_FRAMES];
+    int index = (int) (position % p->count);
+    int first = position < p->count;
+    int skipped = p->bad[index];
+    unlockMutex(&p->mutex);
+    
+    if (!skipped) {
+      TRACE_BEGIN("decodeFrame");
+      skipped = !loadFrame(p, &frame->loader, p->paths[index]);
+      TRACE_END("decodeFrame");
+    }
+    
+    lockMutex(&p->mutex);
+    frame->position = position;
+    frame->skipped = skipped;
+    frame->ready = 1;
+    if (skipped && first) {
+      p->bad[index] = 1;
+      p->badFiles++;
+    }
+    broadcastCond(&p->changed);
+  }
+  unlockMutex(&p->mutex);
+}
+
+
+// Opens and decodes the frame at path into loader. Returns 0, with the
+// loader closed and the reason printed, if it cannot be used.
+int loadFrame(Player *p, Loader *loader, const char *path) {
+  if (!openImage(loader, path, &p->options)) {
+    fprintf(stderr, "Error: Unable to open %s.\n", path);
+    return 0;
+  }
+  waitForImage(loader);
+  
+  // Mapped frames are touched here so the upload takes no page faults
+  Header h = loader->header;
+  size_t bytes = (size_t) h.width * h.height * h.channels;
+  volatile unsigned char sum = 0;
+  for (size_t i = 0; loader->buffer == NULL && i < bytes; i += 4096) {
+    sum += loader->pixels[i];
+  }
+  
+  if (h.width != p->header.width || h.height != p->header.height ||
+      h.channels != p->header.channels) {
+    fprintf(stderr, "Error: %s is %ux%u, unlike the first frame.\n", path, h.width, h.height);
+    closeImage(loader);
+    return 0;
+  }
+  if (loadFailed(&loader->progress)) {
+    closeImage(loader);
+    return 0;
+  }
+  return 1;
+}
+
+
+// Shows the latest decoded frame that is due at now by uploading it into
+// the back tiles and swapping. Decoded frames it overtakes are dropped, and
+// a frame that is not decoded in time holds up the ones after it. Skipped
+// frames are released as they come due, leaving the frame before on screen.
+// Returns the tiles to draw, or NULL until the first frame is decoded.
+TileSet *showFrame(Player *p, double now) {
+  // The clock stops while paused
+  if (p->paused) {
+    if (p->pausedAt == 0) {
+      p->pausedAt = now;
+    }
+    return p->shown >= 0 ? &p->tiles[p->front] : NULL;
+  }
+  if (p->pausedAt != 0) {
+    p->started += now - p->pausedAt;
+    p->pausedAt = 0;
+  }
+  
+  // Frames are released in order, so p->released is the next one to look at
+  long long due = p->shown < 0 ? p->released : (long long) ((now - p->started) * p->rate);
+  long long last = -1;
+  for (long long position = p->released; position <= due; position++) {
+    PlayFrame *frame = &p->frames[position % PLAY_FRAMES];
+    lockMutex(&p->mutex);
+    int ready = frame->ready && frame->position == position;
+    int skipped = frame->skipped;
+    unlockMutex(&p->mutex);
+    if (!ready) {
+      break;
+    }
+    if (skipped && last >= 0) {
+      // Frames are released in order, so the one found goes up first
+      break;
+    }
+    if (skipped) {
+      releaseFrame(p, position);
+      p->skipped++;
+      // Before the first frame, the next one is due at once
+      if (p->shown < 0) {
+        due++;
+      }
+      continue;
+    }
+    if (last >= 0) {
+      releaseFrame(p, last);
+      p->dropped++;
+    }
+    last = position;
+  }
+  
+  if (last >= 0) {
+    int back = !p->front;
+    TRACE_BEGIN("uploadFrame");
+    uploadFrame(&p->tiles[back], p->frames[last % PLAY_FRAMES].loader.pixels);
+    TRACE_END("uploadFrame");
+    releaseFrame(p, last);
+    
+    // Playing starts from when the first frame is ready, which comes after
+    // any skipped at the start
+    if (p->shown < 0) {
+      p->started = now - last / p->rate;
+    }
+    p->front = back;
+    p->shown = last;
+    p->displayed++;
+    TRACE_COUNTER("frames dropped", p->dropped);
+  }
+  return p->shown >= 0 ? &p->tiles[p->front] : NULL;
+}
+
+
+// Closes a decoded frame, which lets the workers reuse its slot. Frames are
+// released in sequence order. Skipped frames were closed by the worker.
+void releaseFrame(Player *p, long long position) {
+  PlayFrame *frame = &p->frames[position % PLAY_FRAMES];
+  
+  if (!frame->skipped) {
+    closeImage(&frame->loader);
+  }
+  lockMutex(&p->mutex);
+  frame->ready = 0;
+  p->released = position + 1;
+  broadcastCond(&p->changed);
+  unlockMutex(&p->mutex);
+}
+
+
+// Replaces every tile of t with a frame of the same size. Textures are kept
+// and refilled with glTexSubImage2D, and the frame is not needed after.
+void uploadFrame(TileSet *t, const unsigned char *pixels) {
+  size_t count = (size_t) t->columns * t->rows;
+  
+  t->pixels = pixels;
+  t->rowsReady = t->height;
+  for (size_t i = 0; i < count; i++) {
+    t->tiles[i].rowsUploaded = 0;
+    uploadTile(t, &t->tiles[i]);
+  }
+  t->pixels = NULL;
+}
+
+
+// Stops the workers and closes the frames still in the ring
+void stopPlayer(Player *p) {
+  lockMutex(&p->mutex);
+  p->stopping = 1;
+  broadcastCond(&p->changed);
+  unlockMutex(&p->mutex);
+  for (int i = 0; i < p->workerCount; i++) {
+    joinThread(p->workers[i]);
+  }
+  
+  for (int i = 0; i < PLAY_FRAMES; i++) {
+    if (p->frames[i].ready && !p->frames[i].skipped) {
+      closeImage(&p->frames[i].loader);
+    }
+    p->frames[i].ready = 0;
+  }
+  for (int i = 0; i < 2; i++) {
+    freeTiles(&p->tiles[i]);
+  }
+  free(p->bad);
+}
+
+
+// Prints how well the sequence kept up with its frame rate
+void writePlayReport(FILE *out, Player *p, double now) {
+  double end = p->pausedAt != 0 ? p->pausedAt : now;
+  double elapsed = p->shown >= 0 ? end - p->started : 0;
+  
+  fprintf(out, "Played %lu frames in %.2f s: %.2f fps sustained at %.2f wanted, %lu dropped, "
+          "%lu skipped\n", p->displayed, elapsed, elapsed > 0 ? p->displayed / elapsed : 0,
+          p->rate, p->dropped, p->skipped);
+}
+
+
+// Maps the shared-memory ring called name. Until a producer has created it
+// and written its magic number, waits and tries again. Exits if it cannot be
+// used.
+void openShared(SharedSource *s, const char *name, size_t budget) {
+  memset(s, 0, sizeof(SharedSource));
+  s->name = name;
+  s->budget = budget;
+  
+#ifdef _WIN32
+  fprintf(stderr, "Error: Shared memory input is not supported on Windows.\n");
+  exit(1);
+#else
+  struct timespec wait = {SHM_WAIT_MS / 1000, SHM_WAIT_MS % 1000 * 1000000L};
+  for (int tries = 0; (s->ring = mapRing(name, &s->size)) == NULL; tries++) {
+    if (tries == 0) {
+      fprintf(stderr, "Waiting for a producer to create %s.\n", name);
+    }
+    nanosleep(&wait, NULL);
+  }
+  
+  if (s->ring->version != SHM_RING_VERSION || s->ring->slotCount == 0 ||
+      shmRingSize(s->ring->slotCount, s->ring->capacity) > s->size) {
+    fprintf(stderr, "Error: %s is not an ezview frame ring.\n", name);
+    exit(1);
+  }
+#endif
+}
+
+
+#ifndef _WIN32
+// Maps the shared-memory ring called name and sets size to its size.
+// Returns NULL if it does not exist yet or its header is not written yet,
+// and exits if it cannot be opened or mapped.
+ShmRing *mapRing(const char *name, size_t *size) {
+  struct stat st;
+  int fd = shm_open(name, O_RDONLY, 0);
+  
+  if (fd < 0 && errno == ENOENT) {
+    return NULL;
+  }
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Error: Unable to open shared memory %s.\n", name);
+    exit(1);
+  }
+  // The producer sizes the object before it writes the header
+  if ((size_t) st.st_size < SHM_RING_HEADER_SIZE) {
+    close(fd);
+    return NULL;
+  }
+  ShmRing *ring = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    fprintf(stderr, "Error: Unable to map shared memory %s.\n", name);
+    exit(1);
+  }
+  
+  // The magic number is stored last with release order, so once it is
+  // seen the rest of the header is too
+  if (atomic_load_explicit(&ring->magic, memory_order_acquire) != SHM_RING_MAGIC) {
+    munmap(ring, st.st_size);
+    return NULL;
+  }
+  *size = st.st_size;
+  return ring;
+}
+#endif
+
+
+// Uploads the newest published frame, if it is not on screen yet, into the
+// back tiles and swaps. The pixels go to glTexSubImage2D from the ring
+// itself. The slot's sequence is checked again after the upload, and a
+// frame the producer started to overwrite meanwhile is not shown. Returns
+// the tiles to draw, or NULL until a frame is in.
+TileSet *showShared(SharedSource *s) {
+  TileSet *current = s->valid ? &s->tiles[s->front] : NULL;
+#ifndef _WIN32
+  ShmRing *ring = s->ring;
+  unsigned long long published = atomic_load_explicit(&ring->published, memory_order_acquire);
+  if (published == 0 || published == s->published) {
+    return current;
+  }
+  
+  // An odd sequence means the producer has come around to the slot again
+  ShmSlot *slot = shmSlot(ring, published - 1);
+  unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+  if (sequence & 1) {
+    return current;
+  }
+  Header h = {slot->format == SHM_FORMAT_GRAY ? 5 : 6, slot->width, slot->height, 255,
+              slot->format};
+  unsigned long long frame = slot->frame;
+  if ((h.channels != SHM_FORMAT_GRAY && h.channels != SHM_FORMAT_RGB) || h.width == 0 ||
+      h.height == 0 || (unsigned long long) h.width * h.height * h.channels > ring->capacity) {
+    return current;
+  }
+  
+  // Frames of a new size need new textures
+  if (!s->hasTiles || h.width != s->header.width || h.height != s->header.height ||
+      h.channels != s->header.channels) {
+    if (tileBytes(h.width, h.height, h.channels) > s->budget / 2) {
+      fprintf(stderr, "Error: Two frames need more texture memory than --budget.\n");
+      exit(1);
+    }
+    for (int i = 0; s->hasTiles && i < 2; i++) {
+      freeTiles(&s->tiles[i]);
+    }
+    for (int i = 0; i < 2; i++) {
+      initTiles(&s->tiles[i], h.width, h.height, h.channels, NULL, s->budget / 2);
+      s->tiles[i].streaming = 1;
+    }
+    s->header = h;
+    s->hasTiles = 1;
+    s->valid = 0;
+    current = NULL;
+  }
+  
+  int back = !s->front;
+  TRACE_BEGIN("uploadShared");
+  uploadFrame(&s->tiles[back], shmPixels(slot));
+  TRACE_END("uploadShared");
+  atomic_thread_fence(memory_order_acquire);
+  if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) != sequence) {
+    s->torn++;
+    return current;
+  }
+  
+  if (s->displayed > 0 && frame > s->frame + 1) {
+    s->dropped += frame - s->frame - 1;
+  }
+  s->front = back;
+  s->valid = 1;
+  s->frame = frame;
+  s->published = published;
+  s->displayed++;
+  TRACE_COUNTER("frames dropped", s->dropped);
+  return &s->tiles[s->front];
+#else
+  return current;
+#endif
+}
+
+
+// Unmaps the ring and frees the textures
+void closeShared(SharedSource *s) {
+  for (int i = 0; s->hasTiles && i < 2; i++) {
+    freeTiles(&s->tiles[i]);
+  }
+#ifndef _WIN32
+  munmap(s->ring, s->size);
+#endif
+  s->ring = NULL;
+}
+
+
+// Prints how many published frames were shown
+void writeSharedReport(FILE *out, SharedSource *s) {
+  fprintf(out, "Showed %lu frames from %s, %lu dropped, %lu uploads torn\n", s->displayed,
+          s->name, s->dropped, s->torn);
+}
+
+
+// Starts the thread that follows the file shown for --watch. Reloads use
+// options and set up tiles within budget when the size changes.
+void startWatcher(Watcher *w, const LoadOptions *options, size_t budget) {
+  memset(w, 0, sizeof(Watcher));
+  w->options = *options;
+  // The new version replaces the old at once, so there is nothing to preview
+  w->options.preview = 1;
+  w->budget = budget;
+  w->notify = -1;
+  w->watch = -1;
+  initMutex(&w->mutex);
+#ifdef __linux__
+  w->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+  
+  w->running = startThread(&w->thread, watchFile, w);
+  if (!w->running) {
+    fprintf(stderr, "Error: Unable to start watching files.\n");
+    exit(1);
+  }
+}
+
+
+// Points the watcher at the image shown, dropping the reload of the one
+// before. Pixels used in place from a mapping are copied first, since a
+// rewrite of the file would change them before they could be compared. An
+// image too big to copy stays mapped and goes unwatched.
+void watchImage(Watcher *w, CachedImage *entry) {
+  Loader *image = &entry->loader;
+  const char *path = image->path;
+  
+  if (w->reloading) {
+    closeImage(&w->next);
+    w->reloading = 0;
+  }
+  if (image->buffer == NULL && image->pixels != NULL) {
+    size_t bytes = (size_t) image->header.width * image->header.height * image->header.channels;
+    unsigned char *copy = malloc(bytes);
+    if (copy == NULL) {
+      fprintf(stderr, "Warning: Not enough memory to watch %s, so it is not watched.\n", path);
+      path = NULL;
+    } else {
+      memcpy(copy, image->pixels, bytes);
+      unmapFile(&image->map);
+      image->buffer = copy;
+      image->pixels = copy;
+      if (entry->hasTiles) {
+        entry->tiles.pixels = copy;
+      }
+    }
+  }
+  
+  lockMutex(&w->mutex);
+  w->path = path;
+  w->size = image->sourceSize;
+  w->time = image->sourceTime;
+  w->changed = 0;
+  w->retarget = 1;
+  unlockMutex(&w->mutex);
+}
+
+
+// Runs on the watcher thread. Flags the file as changed, and wakes the
+// render thread, once its stamp differs from that of the version shown.
+void watchFile(void *arg) {
+  Watcher *w = arg;
+  unsigned long long seenSize = 0;
+  long long seenTime = -1;
+  
+  lockMutex(&w->mutex);
+  while (!w->stopping) {
+    const char *path = w->path;
+    int retarget = w->retarget;
+    w->retarget = 0;
+    unlockMutex(&w->mutex);
+    
+#ifdef __linux__
+    // Many tools write a new file and rename it over the old one, so the
+    // directory is watched rather than the file
+    if (retarget && w->notify >= 0 && path == NULL && w->watch >= 0) {
+      inotify_rm_watch(w->notify, w->watch);
+      w->watch = -1;
+    }
+    if (retarget && w->notify >= 0 && path != NULL) {
+      const char *slash = strrchr(path, '/');
+      size_t length = slash == NULL ? 1 : slash == path ? 1 : (size_t) (slash - path);
+      char *dir = malloc(length + 1);
+      if (dir != NULL) {
+        memcpy(dir, slash == NULL ? "." : path, length);
+        dir[length] = '\0';
+        if (w->watch >= 0) {
+          inotify_rm_watch(w->notify, w->watch);
+        }
+        w->watch = inotify_add_watch(w->notify, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+        free(dir);
+      }
+    }
+#endif
+    
+    int written = waitForEvent(w, path);
+    unsigned long long size = 0;
+    long long time = -1;
+    int exists = path != NULL && fileStamp(path, &size, &time);
+    
+    lockMutex(&w->mutex);
+    if (exists && path == w->path && !w->retarget) {
+      // A file closed after writing or moved into place is done. A stamp
+      // that merely moved may be a file still being written, so polling
+      // waits for it to hold still for an interval.
+      int settled = written || (size == seenSize && time == seenTime);
+      if (settled && (size != w->size || time != w->time) && !w->changed) {
+        w->changed = 1;
+        raiseFlag(&needs_redraw);
+        glfwPostEmptyEvent();
+      }
+    }
+    seenSize = size;
+    seenTime = time;
+  }
+  unlockMutex(&w->mutex);
+}
+
+
+// Waits up to WATCH_INTERVAL_MS for the file at path to be written or
+// replaced. Returns 1 if inotify told of it, and 0 otherwise.
+int waitForEvent(Watcher *w, const char *path) {
+#ifdef __linux__
+  if (w->notify >= 0 && w->watch >= 0 && path != NULL) {
+    struct pollfd fds = {w->notify, POLLIN, 0};
+    if (poll(&fds, 1, WATCH_INTERVAL_MS) <= 0) {
+      return 0;
+    }
+    
+    // Events name files in the watched directory
+    const char *slash = strrchr(path, '/');
+    const char *name = slash != NULL ? slash + 1 : path;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int written = 0;
+    ssize_t length;
+    while ((length = read(w->notify, events, sizeof(events))) > 0) {
+      for (char *p = events; p < events + length; ) {
+        struct inotify_event *event = (struct inotify_event *) p;
+        if (event->len > 0 && strcmp(event->name, name) == 0) {
+          written = 1;
+        }
+        p += sizeof(struct inotify_event) + event->len;
+      }
+    }
+    return written;
+  }
+#endif
+#ifdef _WIN32
+  Sleep(WATCH_INTERVAL_MS);
+#else
+  struct timespec ts = {WATCH_INTERVAL_MS / 1000, WATCH_INTERVAL_MS % 1000 * 1000000L};
+  nanosleep(&ts, NULL);
+#endif
+  return 0;
+}
+
+
+// Brings the image shown up to date once the watcher has seen its file
+// change. The file is decoded again in the background over later frames.
+// When it is in, only the bands of rows that differ from those shown are
+// uploaded. Returns 1 if the image changed size instead, in which case its
+// tiles are set up again.
+int refreshImage(Watcher *w, CachedImage *entry) {
+  Loader *image = &entry->loader;
+  Loader *next = &w->next;
+  TileSet *t = &entry->tiles;
+  
+  if (!w->reloading) {
+    // The version shown has to be decoded before it can be compared
+    lockMutex(&w->mutex);
+    int changed = w->changed && readyRows(&image->progress) == image->header.height;
+    if (changed) {
+      w->changed = 0;
+    }
+    unlockMutex(&w->mutex);
+    if (!changed) {
+      return 0;
+    }
+    
+    // The stamp is taken even from a version that cannot be opened, so it
+    // is tried again once the file changes rather than at every check. A
+    // file that went away again is looked for by the watcher as before.
+    w->reloaded = nowSeconds();
+    int opened = openImage(next, w->path, &w->options);
+    lockMutex(&w->mutex);
+    w->size = next->sourceSize;
+    w->time = next->sourceTime;
+    unlockMutex(&w->mutex);
+    if (!opened) {
+      fprintf(stderr, "Warning: %s is shown as it was until it changes again.\n", w->path);
+      return 0;
+    }
+    lockMutex(&next->progress.mutex);
+    next->progress.notify = 1;
+    unlockMutex(&next->progress.mutex);
+    w->reloading = 1;
+  }
+  // A version that breaks off, such as one caught half written, is dropped
+  // and the one shown stays
+  if (loadFailed(&next->progress)) {
+    fprintf(stderr, "Warning: %s is shown as it was until it changes again.\n", w->path);
+    closeImage(next);
+    w->reloading = 0;
+    return 0;
+  }
+  if (readyRows(&next->progress) < next->header.height) {
+    return 0;
+  }
+  waitForImage(next);
+  waitForImage(image);
+  w->reloading = 0;
+  double decoded = nowSeconds();
+  
+  // The new pixels are taken over, or copied out of a mapping
+  Header h = next->header;
+  unsigned char *pixels = next->buffer;
+  next->buffer = NULL;
+  if (pixels == NULL) {
+    size_t bytes = (size_t) h.width * h.height * h.channels;
+    pixels = malloc(bytes);
+    if (pixels == NULL) {
+      // The version shown stays until the next change
+      fprintf(stderr, "Error: Not enough memory to refresh %s.\n", w->path);
+      closeImage(next);
+      return 0;
+    }
+    memcpy(pixels, next->pixels, bytes);
+  }
+  image->sourceSize = next->sourceSize;
+  image->sourceTime = next->sourceTime;
+  image->source = next->source;
+  image->region = next->region;
+  image->overview = next->overview;
+  closeImage(next);
+  
+  int resized = h.width != image->header.width || h.height != image->header.height ||
+                h.channels != image->header.channels;
+  unsigned int changed = 0, bands = 0;
+  double compared = nowSeconds(), uploading = 0;
+  TRACE_BEGIN("refreshImage");
+  if (resized) {
+    // Nothing lines up with the old tiles
+    freeTiles(t);
+    initTiles(t, h.width, h.height, h.channels, pixels, w->budget);
+    t->live = 1;
+    if (entry->hasPreviewTiles) {
+      freeTiles(&entry->previewTiles);
+      entry->hasPreviewTiles = 0;
+    }
+    free(image->preview);
+    image->preview = NULL;
+  }
+  else {
+    // An overview is decimated again from the new pixels on the next frame
+    if (image->overview > 0 && entry->hasPreviewTiles) {
+      freeTiles(&entry->previewTiles);
+      entry->hasPreviewTiles = 0;
+      free(image->preview);
+      image->preview = NULL;
+    }
+    
+    // Rows are compared in order, and each band of changed rows is
+    // uploaded once a gap wider than REFRESH_BAND_GAP ends it
+    size_t rowBytes = (size_t) h.width * h.channels;
+    unsigned int start = 0, end = 0;
+    t->pixels = pixels;
+    for (unsigned int y = 0; y < h.height; y++) {
+      if (sameBytes(image->pixels + y * rowBytes, pixels + y * rowBytes, rowBytes)) {
+        continue;
+      }
+      changed++;
+      if (end > 0 && y - end > REFRESH_BAND_GAP) {
+        double started = nowSeconds();
+        refreshRows(t, start, end - start);
+        uploading += nowSeconds() - started;
+        bands++;
+        end = 0;
+      }
+      start = end > 0 ? start : y;
+      end = y + 1;
+    }
+    if (end > 0) {
+      double started = nowSeconds();
+      refreshRows(t, start, end - start);
+      uploading += nowSeconds() - started;
+      bands++;
+    }
+  }
+  TRACE_END("refreshImage");
+  compared = nowSeconds() - compared - uploading;
+  
+  free(image->buffer);
+  image->buffer = pixels;
+  image->pixels = pixels;
+  image->header = h;
+  lockMutex(&image->progress.mutex);
+  image->progress.rowsReady = h.height;
+  unlockMutex(&image->progress.mutex);
+  
+  // The histogram is counted again on the next frame
+  if (entry->hasHistogramTiles) {
+    freeTiles(&entry->histogramTiles);
+    free(entry->histogramPlot);
+    entry->histogramPlot = NULL;
+  }
+  entry->hasHistogram = 0;
+  entry->hasHistogramTiles = 0;
+  
+  if (resized) {
+    printf("Reloaded %s at %ux%u: decoded in %.1f ms\n", w->path, h.width, h.height,
+           (decoded - w->reloaded) * 1000);
+  }
+  else {
+    printf("Refreshed %s: decoded in %.1f ms, %u of %u rows changed, compared in %.3f ms, "
+           "%u bands uploaded in %.3f ms\n", w->path, (decoded - w->reloaded) * 1000, changed,
+           h.height, compared * 1000, bands, uploading * 1000);
+  }
+  fflush(stdout);
+  return resized;
+}
+
+
+// Uploads rows first to first + count - 1 of t->pixels over the tiles that
+// already hold them, with the mip levels they feed into. Tiles not resident
+// get the new rows whenever they are uploaded.
+void refreshRows(TileSet *t, unsigned int first, unsigned int count) {
+  size_t tileCount = (size_t) t->columns * t->rows;
+  GLenum format = t->channels == 1 ? GL_LUMINANCE : GL_RGB;
+  
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (size_t i = 0; i < tileCount; i++) {
+    Tile *tile = &t->tiles[i];
+    // The border past the first and last rows of the image repeats them
+    long long from = first == 0 ? 0 : (long long) first - tile->y;
+    long long to = first + count == t->height ? tile->height : (long long) first + count - tile->y;
+    to = to < tile->rowsUploaded ? to : tile->rowsUploaded;
+    unsigned int top = from > 0 ? (unsigned int) from : 0;
+    unsigned int bottom = to > 0 ? (unsigned int) to : 0;
+    if (tile->texture == 0 || top >= bottom) {
+      continue;
+    }
+    glBindTexture(GL_TEXTURE_2D, tile->texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, top, tile->width, bottom - top, format,
+                    GL_UNSIGNED_BYTE, tileRows(t, tile, top, bottom - top));
+    if (tile->rowsUploaded == tile->height && hasMipmaps(t, tile)) {
+      refreshMipmaps(t, tile, top, bottom - top);
+    }
+  }
+}
+
+
+// Stops the watcher thread and drops a reload in progress
+void stopWatcher(Watcher *w) {
+  lockMutex(&w->mutex);
+  w->stopping = 1;
+  unlockMutex(&w->mutex);
+  joinThread(w->thread);
+  
+  if (w->reloading) {
+    closeImage(&w->next);
+    w->reloading = 0;
+  }
+#ifdef __linux__
+  if (w->notify >= 0) {
+    close(w->notify);
+  }
+#endif
+}
+
+
+// Expands the input arguments into the files to browse. Each directory
+// adds the PPM files in it, sorted by name. Returns the number of files.
+int listImages(char ***paths, char **args, int count) {
+  int length = 0, capacity = 0;
+  
+  *paths = NULL;
+  for (int i = 0; i < count; i++) {
+    int listed = isDirectory(args[i]) ? listDirectory(paths, &length, &capacity, args[i]) :
+                                        appendPath(paths, &length, &capacity, NULL, args[i]);
+    if (!listed) {
+      fprintf(stderr, "Error: Unable to list %s.\n", args[i]);
+      exit(1);
+    }
+  }
+  return length;
+}
+
+
+// Appends the PPM files in a directory to a list of paths, in name order
+int listDirectory(char ***paths, int *length, int *capacity, const char *dir) {
+  int first = *length;
+  
+#ifdef _WIN32
+  char pattern[MAX_PATH];
+  WIN32_FIND_DATAA found;
+  snprintf(pattern, sizeof(pattern), "%s\\*", dir);
+  HANDLE search = FindFirstFileA(pattern, &found);
+  if (search == INVALID_HANDLE_VALUE) {
+    return 0;
+  }
+  do {
+    if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && isImageName(found.cFileName) &&
+        !appendPath(paths, length, capacity, dir, found.cFileName)) {
+      FindClose(search);
+      return 0;
+    }
+  } while (FindNextFileA(search, &found));
+  FindClose(search);
+#else
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    return 0;
+  }
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (isImageName(e->d_name) && !appendPath(paths, length, capacity, dir, e->d_name)) {
+      closedir(d);
+      return 0;
+    }
+    // Skip directories that happen to have an image name
+    if (*length > first && isDirectory((*paths)[*length - 1])) {
+      free((*paths)[--*length]);
+    }
+  }
+  closedir(d);
+#endif
+  
+  qsort(*paths + first, *length - first, sizeof(char *), comparePaths);
+  return 1;
+}
+
+
+// Appends dir/name to a list of paths, or just name if dir is NULL
+int appendPath(char ***paths, int *length, int *capacity, const char *dir, const char *name) {
+  if (*length == *capacity) {
+    int grown = *capacity > 0 ? *capacity * 2 : 64;
+    char **list = realloc(*paths, sizeof(char *) * grown);
+    if (list == NULL) {
+      return 0;
+    }
+    *paths = list;
+    *capacity = grown;
+  }
+  
+  size_t dirLength = dir != NULL ? strlen(dir) : 0;
+  char *path = malloc(dirLength + strlen(name) + 2);
+  if (path == NULL) {
+    return 0;
+  }
+  if (dir != NULL) {
+    sprintf(path, "%s/%s", dir, name);
+  }
+  else {
+    strcpy(path, name);
+  }
+  (*paths)[(*length)++] = path;
+  return 1;
+}
+
+
+// Checks whether a path names a directory
+int isDirectory(const char *path) {
+#ifdef _WIN32
+  DWORD attributes = GetFileAttributesA(path);
+  return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+  struct stat info;
+  return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+
+// Checks for the extensions of files the browser picks up from directories.
+// Compressed files that this build can read keep the extension of what they
+// hold before their own.
+int isImageName(const char *name) {
+  size_t length = strlen(name);
+  size_t count = length < 8 ? length : 8;
+  char ext[9];
+  
+  for (size_t i = 0; i <= count; i++) {
+    ext[i] = tolower((unsigned char) name[length - count + i]);
+  }
+#ifdef EZVIEW_ZLIB
+  if (count >= 3 && strcmp(ext + count - 3, ".gz") == 0) {
+    count -= 3;
+  }
+#endif
+#ifdef EZVIEW_ZSTD
+  if (count >= 4 && strcmp(ext + count - 4, ".zst") == 0) {
+    count -= 4;
+  }
+#endif
+  if (count < 4) {
+    return 0;
+  }
+  ext[count] = '\0';
+  
+  const char *dot = ext + count - 4;
+  return strcmp(dot, ".ppm") == 0 || strcmp(dot, ".pnm") == 0 ||
+         strcmp(dot, ".pgm") == 0 || strcmp(dot, ".pbm") == 0;
+}
+
+
+// Orders paths for qsort
+int comparePaths(const void *a, const void *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+// Sets up an empty cache for browsing the given files
+void initCache(ImageCache *cache, char **paths, int count, size_t budget,
+               const LoadOptions *options) {
+  memset(cache, 0, sizeof(ImageCache));
+  cache->paths = paths;
+  cache->count = count;
+  cache->budget = budget;
+  cache->options = *options;
+  for (int i = 0; i < CACHE_ENTRIES; i++) {
+    cache->entries[i].index = -1;
+  }
+}
+
+
+// Returns the cached image for a file, starting to decode it in the
+// background if it is not cached. Returns NULL if the file cannot be opened.
+CachedImage *cacheImage(ImageCache *cache, int index) {
+  CachedImage *unused = NULL, *oldest = NULL;
+  
+  for (int i = 0; i < CACHE_ENTRIES; i++) {
+    CachedImage *entry = &cache->entries[i];
+    if (entry->index == index) {
+      entry->lastUsed = ++cache->clock;
+      return entry;
+    }
+    if (entry->index < 0) {
+      unused = unused != NULL ? unused : entry;
+    }
+    else if (oldest == NULL || entry->lastUsed < oldest->lastUsed) {
+      oldest = entry;
+    }
+  }
+  
+  // With every entry taken, the least recently used one makes room
+  if (unused == NULL) {
+    releaseImage(oldest);
+    unused = oldest;
+  }
+  if (!openImage(&unused->loader, cache->paths[index], &cache->options)) {
+    return NULL;
+  }
+  unused->index = index;
+  unused->hasTiles = 0;
+  unused->hasPreviewTiles = 0;
+  unused->hasHistogram = 0;
+  unused->hasHistogramTiles = 0;
+  unused->passedOver = 0;
+  unused->lastUsed = ++cache->clock;
+  return unused;
+}
+
+
+// Starts decoding the images next to the one shown, then trims the cache
+void prefetchImages(ImageCache *cache, int current) {
+  for (int d = 1; d <= PREFETCH_DISTANCE && d < cache->count; d++) {
+    cacheImage(cache, (current + d) % cache->count);
+    cacheImage(cache, (current - d + cache->count) % cache->count);
+  }
+  evictImages(cache, current);
+}
+
+
+// Releases the least recently used images until the cache is within its
+// budget. The image shown and its prefetched neighbors are kept.
+void evictImages(ImageCache *cache, int current) {
+  for (;;) {
+    size_t total = 0;
+    CachedImage *oldest = NULL;
+    
+    for (int i = 0; i < CACHE_ENTRIES; i++) {
+      CachedImage *entry = &cache->entries[i];
+      if (entry->index < 0) {
+        continue;
+      }
+      total += imageBytes(entry);
+      
+      int distance = abs(entry->index - current);
+      distance = distance < cache->count - distance ? distance : cache->count - distance;
+      if (distance > PREFETCH_DISTANCE &&
+          (oldest == NULL || entry->lastUsed < oldest->lastUsed)) {
+        oldest = entry;
+      }
+    }
+    
+    if (total <= cache->budget || oldest == NULL) {
+      break;
+    }
+    releaseImage(oldest);
+  }
+}
+
+
+// Estimates the memory held by a cached image, decoded and as textures
+size_t imageBytes(CachedImage *entry) {
+  Loader *image = &entry->loader;
+  size_t bytes = 0;
+  
+  if (image->buffer != NULL) {
+    bytes += (size_t) image->header.width * image->header.height * image->header.channels;
+  }
+  else if (image->pixels != NULL) {
+    // Mapped P6 data
+    bytes += image->map.size;
+  }
+  if (image->preview != NULL) {
+    bytes += (size_t) image->previewHeader.width * image->previewHeader.height *
+             image->previewHeader.channels;
+  }
+  if (entry->hasTiles) {
+    bytes += entry->tiles.residentBytes + entry->tiles.blockBytes;
+  }
+  if (entry->hasPreviewTiles) {
+    bytes += entry->previewTiles.residentBytes;
+  }
+  return bytes;
+}
+
+
+// Drops a cached image, waiting for its decoding to finish first
+void releaseImage(CachedImage *entry) {
+  closeImage(&entry->loader);
+  if (entry->hasTiles) {
+    freeTiles(&entry->tiles);
+  }
+  if (entry->hasPreviewTiles) {
+    freeTiles(&entry->previewTiles);
+  }
+  if (entry->hasHistogramTiles) {
+    freeTiles(&entry->histogramTiles);
+    free(entry->histogramPlot);
+    entry->histogramPlot = NULL;
+  }
+  entry->hasTiles = 0;
+  entry->hasPreviewTiles = 0;
+  entry->hasHistogram = 0;
+  entry->hasHistogramTiles = 0;
+  entry->index = -1;
+}
+
+
+// Builds the MVP for the current transform in a framebuffer of the given size
+void viewMatrix(mat4x4 mvp, int width, int height) {
+  float ratio = width / (float) height;
+  mat4x4 p;
+  
+  mat4x4_identity(mvp);
+  mat4x4_ortho(p, -ratio, ratio, -1.f, 1.f, 1.f, -1.f);
+  mat4x4_mul(mvp, p, mvp);
+  mat4x4_mul(mvp, current_transform, mvp);
+}
+
+
+// Applies each character of keys to the current transform as if its key
+// had been pressed
+void replayKeys(const char *keys) {
+  for (; *keys != '\0'; keys++) {
+    replayKey(*keys);
+  }
+}
+
+
+// Applies the transform of a single key press, which --record leaves out
+void replayKey(int c) {
+  // Letters and digits have the same codes as their GLFW keys
+  key_callback(NULL, toupper((unsigned char) c), 0, GLFW_PRESS, 0);
+}
+
+
+// Reads the keys saved by --record, leaving out whitespace. Returns NULL if
+// the file cannot be read.
+char *readKeyFile(const char *path) {
+  FILE *fh = fopen(path, "r");
+  if (fh == NULL)
+    return NULL;
+  
+  size_t length = 0, capacity = 256;
+  char *keys = malloc(capacity);
+  int c;
+  while (keys != NULL && (c = fgetc(fh)) != EOF) {
+    if (isspace(c))
+      continue;
+    if (length + 1 == capacity) {
+      char *grown = realloc(keys, capacity * 2);
+      if (grown == NULL) {
+        free(keys);
+        keys = NULL;
+        break;
+      }
+      keys = grown;
+      capacity *= 2;
+    }
+    keys[length++] = (char) c;
+  }
+  if (keys != NULL)
+    keys[length] = '\0';
+  fclose(fh);
+  return keys;
+}
+
+
+// Returns a monotonic time in seconds, for measuring intervals
+double nowSeconds(void) {
+#ifdef _WIN32
+  LARGE_INTEGER count, frequency;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&frequency);
+  return (double) count.QuadPart / (double) frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+
+// Prints the timings of a benchmark as a JSON object, in milliseconds.
+// Frame percentiles use the nearest rank.
+void writeBenchReport(FILE *fh, BenchReport *report) {
+  int n = report->frameCount;
+  double total = 0;
+  qsort(report->frames, n, sizeof(double), compareDoubles);
+  for (int i = 0; i < n; i++) {
+    total += report->frames[i];
+  }
+  
+  double p50 = 0, p95 = 0, p99 = 0;
+  if (n > 0) {
+    p50 = report->frames[(int) ceil(n * 0.50) - 1];
+    p95 = report->frames[(int) ceil(n * 0.95) - 1];
+    p99 = report->frames[(int) ceil(n * 0.99) - 1];
+  }
+  
+  fprintf(fh, "{\n  \"file\": ");
+  writeJsonString(fh, report->path);
+  fprintf(fh, ",\n  \"format\": \"P%u\",\n", report->header.magicNumber);
+  fprintf(fh, "  \"width\": %u,\n  \"height\": %u,\n  \"max_color\": %u,\n",
+          report->header.width, report->header.height, report->header.maxColor);
+  fprintf(fh, "  \"window\": [%d, %d],\n  \"threads\": %d,\n  \"renderer\": ",
+          report->windowWidth, report->windowHeight, report->threads);
+  writeJsonString(fh, report->renderer != NULL ? report->renderer : "");
+  fprintf(fh, ",\n  \"load_ms\": %.3f,\n  \"decode_ms\": %.3f,\n  \"upload_ms\": %.3f,\n",
+          report->load * 1000, report->decode * 1000, report->upload * 1000);
+  fprintf(fh, "  \"histogram_ms\": %.3f,\n  \"histogram_naive_ms\": %.3f,\n"
+          "  \"histogram_matches\": %s,\n", report->histogram * 1000,
+          report->histogramNaive * 1000, report->histogramMatches ? "true" : "false");
+  fprintf(fh, "  \"filter\": \"%s\",\n", filter_names[report->filter]);
+  if (report->compression != 0) {
+    const EncodeStats *e = &report->encoded;
+    fprintf(fh, "  \"etc1\": {\"effort\": \"%s\", \"tiles\": %u, \"encode_ms\": %.3f, "
+            "\"mpixels_per_s\": %.2f, \"psnr_db\": %.2f},\n",
+            report->compression == ETC1_BEST ? "best" : "fast", e->tiles, e->seconds * 1000,
+            e->seconds > 0 ? e->pixels / 1e6 / e->seconds : 0,
+            encodePsnr(e));
+  }
+  // Comparing runs with and without --trace gives its cost per event
+  fprintf(fh, "  \"tracing\": %s,\n  \"trace_events\": %lu,\n",
+          report->tracing ? "true" : "false", report->traceEvents);
+  fprintf(fh, "  \"frames\": %d,\n  \"frame_ms\": {", n);
+  fprintf(fh, "\"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p95\": %.3f, "
+          "\"p99\": %.3f, \"max\": %.3f},\n",
+          n > 0 ? total / n * 1000 : 0, n > 0 ? report->frames[0] * 1000 : 0,
+          p50 * 1000, p95 * 1000, p99 * 1000,
+          n > 0 ? report->frames[n - 1] * 1000 : 0);
+  fprintf(fh, "  \"fps\": %.1f\n}\n", total > 0 ? n / total : 0);
+}
+
+
+// Times the decoding kernels on the pixels of an image scaled to width by
+// height, each against the plain loop it replaced, and prints the rates as
+// JSON. The P3 text is written out from the scaled pixels and read back
+// from a temporary file, then decoded from memory on 1 up to threads
+// threads. The pixels are also halved and made into 16-bit samples to
+// time the mipmap and 16-bit conversion kernels. Returns 0 if there is not
+// enough memory.
+int benchKernels(FILE *fh, const char *path, const unsigned char *pixels, Header h,
+                 unsigned int width, unsigned int height, int threads) {
+  Header big = {3, width, height, 255, 3};
+  size_t samples = (size_t) width * height * 3;
+  unsigned char *image = malloc(samples);
+  unsigned char *decoded = malloc(samples);
+  unsigned char *expected = malloc(samples);
+  unsigned char *wide = malloc(samples * 2);
+  char *text = NULL;
+  size_t textSize = 0;
+  FILE *file = NULL;
+  double started;
+  
+  if (image == NULL || decoded == NULL || expected == NULL || wide == NULL) {
+    fprintf(stderr, "Error: Not enough memory for a %ux%u benchmark.\n", width, height);
+    free(image);
+    free(decoded);
+    free(expected);
+    free(wide);
+    return 0;
+  }
+  
+  // Nearest pixel scaling, with gray repeated into each channel
+  for (unsigned int y = 0; y < height; y++) {
+    const unsigned char *row = pixels + (size_t) ((unsigned long long) y * h.height / height) *
+                                        h.width * h.channels;
+    unsigned char *out = image + (size_t) y * width * 3;
+    for (unsigned int x = 0; x < width; x++) {
+      const unsigned char *p = row + (size_t) ((unsigned long long) x * h.width / width) *
+                                     h.channels;
+      for (int c = 0; c < 3; c++) {
+        *out++ = p[h.channels == 3 ? c : 0];
+      }
+    }
+  }
+  
+  text = writeP3Text(image, samples, width * 3, &textSize);
+  file = tmpfile();
+  if (text == NULL || file == NULL || fwrite(text, 1, textSize, file) != textSize) {
+    fprintf(stderr, "Error: Unable to write the P3 data for the benchmark.\n");
+    if (file != NULL) {
+      fclose(file);
+    }
+    free(text);
+    free(image);
+    free(decoded);
+    free(expected);
+    free(wide);
+    return 0;
+  }
+  
+  // P3, parsed with fscanf a pixel at a time as it used to be, then by the
+  // block scanner
+  rewind(file);
+  started = nowSeconds();
+  int naiveRead = naiveReadP3(expected, big, file);
+  double naive = nowSeconds() - started;
+  rewind(file);
+  started = nowSeconds();
+  int scannerRead = readP3(decoded, big, file, NULL);
+  double scanner = nowSeconds() - started;
+  int p3Matches = naiveRead && scannerRead && memcmp(expected, image, samples) == 0 &&
+                  memcmp(decoded, image, samples) == 0;
+  double megabytes = textSize / 1e6;
+  
+  fprintf(fh, "{\n  \"file\": ");
+  writeJsonString(fh, path);
+  fprintf(fh, ",\n  \"width\": %u,\n  \"height\": %u,\n  \"threads\": %d,\n"
+          "  \"processors\": %d,\n", width, height, threads, cpuCount());
+  fprintf(fh, "  \"p3\": {\"mbytes\": %.1f, \"fscanf_mb_per_s\": %.1f, "
+          "\"scanner_mb_per_s\": %.1f, \"matches\": %s}", megabytes,
+          naive > 0 ? megabytes / naive : 0, scanner > 0 ? megabytes / scanner : 0,
+          p3Matches ? "true" : "false");
+  
+  // The parallel P3 decoder on the text in memory, doubling the thread
+  // count up to --threads, with the speedup over the block scanner alone
+  fprintf(fh, ",\n  \"p3_threads\": [");
+  for (int count = 1;; count = count * 2 < threads ? count * 2 : threads) {
+    memset(decoded, 0, samples);
+    started = nowSeconds();
+    int parallelRead = readP3Parallel(decoded, big, (const unsigned char *) text, textSize,
+                                      count, NULL);
+    double parallel = nowSeconds() - started;
+    fprintf(fh, "%s\n    {\"threads\": %d, \"mb_per_s\": %.1f, \"speedup\": %.2f, "
+            "\"matches\": %s}", count == 1 ? "" : ",", count,
+            parallel > 0 ? megabytes / parallel : 0, parallel > 0 ? scanner / parallel : 0,
+            parallelRead && memcmp(decoded, image, samples) == 0 ? "true" : "false");
+    if (count >= threads) {
+      break;
+    }
+  }
+  fprintf(fh, "\n  ]");
+  
+  // The first mip level of the RGB pixels and of their red channel alone,
+  // by downsample2x2 and by a loop averaging each block on its own. Rates
+  // are in source pixels.
+  fprintf(fh, ",\n  \"downsample\": {");
+  for (int channels = 3; channels >= 1; channels -= 2) {
+    const unsigned char *src = image;
+    size_t half = (size_t) (width > 1 ? width / 2 : 1) * (height > 1 ? height / 2 : 1) * channels;
+    if (channels == 1) {
+      for (size_t i = 0; i < (size_t) width * height; i++) {
+        decoded[i] = image[i * 3];
+      }
+      src = decoded;
+    }
+    started = nowSeconds();
+    naiveDownsample(expected, src, width, height, channels);
+    naive = nowSeconds() - started;
+    started = nowSeconds();
+    downsample2x2(expected + half, src, width, height, channels);
+    double kernel = nowSeconds() - started;
+    double mpixels = (double) width * height / 1e6;
+    fprintf(fh, "\"%s\": {\"naive_mpixels_per_s\": %.1f, \"kernel_mpixels_per_s\": %.1f, "
+            "\"matches\": %s}%s", channels == 3 ? "rgb" : "gray",
+            naive > 0 ? mpixels / naive : 0, kernel > 0 ? mpixels / kernel : 0,
+            memcmp(expected, expected + half, half) == 0 ? "true" : "false",
+            channels == 3 ? ", " : "}");
+  }
+  
+  // 16-bit P6 samples made from the pixels, for a full 16-bit range and a
+  // 12-bit camera, scaled to 8 bits by convertSamples16 and by a loop
+  // scaling one sample at a time
+  fprintf(fh, ",\n  \"convert16\": {");
+  for (int bits = 16; bits >= 12; bits -= 4) {
+    unsigned int maxColor = (1u << bits) - 1;
+    for (size_t i = 0; i < samples; i++) {
+      // Spread each byte over the range, with the spare low bits varying
+      unsigned int v = bits == 16 ? image[i] * 257u : image[i] * 16u + (unsigned int) (i & 15);
+      wide[i * 2] = (unsigned char) (v >> 8);
+      wide[i * 2 + 1] = (unsigned char) v;
+    }
+    started = nowSeconds();
+    naiveConvert16(expected, wide, samples, maxColor);
+    naive = nowSeconds() - started;
+    started = nowSeconds();
+    convertSamples16(decoded, wide, samples, maxColor);
+    double kernel = nowSeconds() - started;
+    double wideMegabytes = samples * 2 / 1e6;
+    fprintf(fh, "\"%u\": {\"loop_mb_per_s\": %.1f, \"kernel_mb_per_s\": %.1f, "
+            "\"matches\": %s}%s", maxColor,
+            naive > 0 ? wideMegabytes / naive : 0, kernel > 0 ? wideMegabytes / kernel : 0,
+            memcmp(expected, decoded, samples) == 0 ? "true" : "false",
+            bits == 16 ? ", " : "}");
+  }
+  fprintf(fh, "\n}\n");
+  
+  fclose(file);
+  free(text);
+  free(image);
+  free(decoded);
+  free(expected);
+  free(wide);
+  return 1;
+}
+
+
+// Writes samples as P3 text, with a line for every rowSamples of them, and
+// sets size to its length. Returns NULL if it cannot be allocated.
+char *writeP3Text(const unsigned char *samples, size_t count, unsigned int rowSamples,
+                  size_t *size) {
+  // At most three digits and a separator for each sample
+  char *text = malloc(count * 4);
+  char *p = text;
+  
+  if (text == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < count; i++) {
+    unsigned int v = samples[i];
+    if (v >= 100) {
+      *p++ = (char) ('0' + v / 100);
+    }
+    if (v >= 10) {
+      *p++ = (char) ('0' + v / 10 % 10);
+    }
+    *p++ = (char) ('0' + v % 10);
+    *p++ = (i + 1) % rowSamples == 0 ? '\n' : ' ';
+  }
+  *size = (size_t) (p - text);
+  return text;
+}
+
+
+// Reads P3 data with fscanf a pixel at a time, for --bench-kernels to
+// compare readP3 with. Returns 0 if the data is too short.
+int naiveReadP3(unsigned char *buffer, Header h, FILE *fh) {
+  size_t count = (size_t) h.width * h.height;
+  unsigned int scale = sampleScale(h.maxColor);
+  unsigned int rgb[3];
+  
+  for (size_t i = 0; i < count; i++) {
+    if (h.channels == 3) {
+      if (fscanf(fh, "%u %u %u", &rgb[0], &rgb[1], &rgb[2]) != 3) {
+        return 0;
+      }
+    }
+    else if (fscanf(fh, "%u", &rgb[0]) != 1) {
+      return 0;
+    }
+    for (unsigned int c = 0; c < h.channels; c++) {
+      buffer[i * h.channels + c] = scaleSample(rgb[c], h.maxColor, scale);
+    }
+  }
+  return 1;
+}
+
+
+// Averages 2x2 blocks one at a time, for --bench-kernels to compare
+// downsample2x2 with
+void naiveDownsample(unsigned char *dst, const unsigned char *src, unsigned int width,
+                     unsigned int height, int channels) {
+  unsigned int dstWidth = width > 1 ? width / 2 : 1;
+  unsigned int dstHeight = height > 1 ? height / 2 : 1;
+  size_t rowBytes = (size_t) width * channels;
+  
+  for (unsigned int y = 0; y < dstHeight; y++) {
+    for (unsigned int x = 0; x < dstWidth; x++) {
+      for (int c = 0; c < channels; c++) {
+        const unsigned char *p = src + (size_t) y * 2 * rowBytes + (size_t) x * 2 * channels + c;
+        unsigned int below = height > 1 ? (unsigned int) rowBytes : 0;
+        unsigned int right = width > 1 ? (unsigned int) channels : 0;
+        *dst++ = (p[0] + p[right] + p[below] + p[below + right] + 2) >> 2;
+      }
+    }
+  }
+}
+
+
+// Scales big-endian 16-bit samples one at a time, for --bench-kernels to
+// compare convertSamples16 with
+void naiveConvert16(unsigned char *dst, const unsigned char *src, size_t count,
+                    unsigned int maxColor) {
+  unsigned int scale = sampleScale(maxColor);
+  
+  for (size_t i = 0; i < count; i++) {
+    unsigned int v = (src[i * 2] << 8) | src[i * 2 + 1];
+    dst[i] = scaleSample(v, maxColor, scale);
+  }
+}
+
+
+// Prints s as a quoted JSON string
+void writeJsonString(FILE *fh, const char *s) {
+  fputc('"', fh);
+  for (; *s != '\0'; s++) {
+    unsigned char c = (unsigned char) *s;
+    if (c == '"' || c == '\\')
+      fprintf(fh, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(fh, "\\u%04x", c);
+    else
+      fputc(c, fh);
+  }
+  fputc('"', fh);
+}
+
+
+// Orders doubles for qsort
+int compareDoubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+
+// Starts recording the events of TRACE_BEGIN, TRACE_END and TRACE_COUNTER.
+// Must be called before other threads are started.
+void startTrace(void) {
+  memset(&trace, 0, sizeof(Trace));
+  initMutex(&trace.mutex);
+  trace.origin = nowSeconds();
+  trace.enabled = 1;
+}
+
+
+// Appends an event to the trace, from any thread
+void traceEvent(const char *name, char phase, double value) {
+  double time = nowSeconds() - trace.origin;
+  
+  lockMutex(&trace.mutex);
+  if (trace_thread == 0) {
+    trace_thread = ++trace.threadCount;
+  }
+  
+  if (trace.count == trace.capacity && trace.capacity < TRACE_MAX_EVENTS) {
+    size_t capacity = trace.capacity > 0 ? trace.capacity * 2 : 4096;
+    TraceEvent *events = realloc(trace.events, sizeof(TraceEvent) * capacity);
+    if (events != NULL) {
+      trace.events = events;
+      trace.capacity = capacity;
+    }
+  }
+  if (trace.count < trace.capacity) {
+    TraceEvent *e = &trace.events[trace.count++];
+    e->name = name;
+    e->phase = phase;
+    e->thread = trace_thread;
+    e->time = time;
+    e->value = value;
+  }
+  else {
+    trace.dropped++;
+  }
+  unlockMutex(&trace.mutex);
+}
+
+
+// Writes the recorded events in the trace event format. Returns 0 if the
+// file could not be written.
+int writeTrace(const char *path) {
+  FILE *fh = fopen(path, "w");
+  if (fh == NULL) {
+    return 0;
+  }
+  
+  lockMutex(&trace.mutex);
+  fprintf(fh, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  for (int i = 0; i < trace.threadCount; i++) {
+    fprintf(fh, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+            "\"args\": {\"name\": \"%s %d\"}},\n", i + 1, i == 0 ? "main" : "thread", i);
+  }
+  for (size_t i = 0; i < trace.count; i++) {
+    TraceEvent *e = &trace.events[i];
+    fprintf(fh, "{\"name\": ");
+    writeJsonString(fh, e->name);
+    fprintf(fh, ", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d",
+            e->phase, e->time * 1e6, e->thread);
+    if (e->phase == 'C') {
+      fprintf(fh, ", \"args\": {\"value\": %.17g}", e->value);
+    }
+    fprintf(fh, "},\n");
+  }
+  // Ends the list without a trailing comma and notes any events lost
+  fprintf(fh, "{\"name\": \"dropped events\", \"ph\": \"C\", \"ts\": 0, \"pid\": 1, "
+          "\"tid\": 1, \"args\": {\"value\": %lu}}\n]}\n", (unsigned long) trace.dropped);
+  unlockMutex(&trace.mutex);
+  
+  return fclose(fh) == 0;
+}
+
+
+// Rasterizes the image quad under mvp into out on the CPU, the way the GL
+// path draws it. Each output pixel is mapped back into the image, and the
+// rows are split into bands across threads.
+void renderSoftware(Pixel *out, int width, int height, const unsigned char *pixels,
+                    Header h, mat4x4 mvp, int bilinear, int threads, const ColorAdjust *color) {
+  RenderJob *jobs = malloc(sizeof(RenderJob) * threads);
+  Thread *handles = malloc(sizeof(Thread) * threads);
+  unsigned char colors[256];
+  if (jobs == NULL || handles == NULL) {
+    fprintf(stderr, "Error: Unable to allocate render threads.");
+    exit(1);
+  }
+  colorTable(colors, color);
+  
+  // The quad is flat and the view is affine, so only the 2D part of mvp
+  // matters: clip = A * model + b
+  float a = mvp[0][0], b = mvp[1][0], c = mvp[0][1], d = mvp[1][1];
+  float tx = mvp[3][0], ty = mvp[3][1];
+  float det = a * d - b * c;
+  
+  for (int i = 0; i < threads; i++) {
+    RenderJob *job = &jobs[i];
+    job->out = out;
+    job->width = width;
+    job->height = height;
+    job->pixels = pixels;
+    job->imageWidth = h.width;
+    job->imageHeight = h.height;
+    job->channels = h.channels;
+    job->bilinear = bilinear;
+    job->firstRow = (int) ((long long) height * i / threads);
+    job->lastRow = (int) ((long long) height * (i + 1) / threads);
+    job->colors = colors;
+    job->channel = color->channel;
+    
+    // A degenerate view covers nothing
+    if (det == 0) {
+      memset(job->inverse, 0, sizeof(job->inverse));
+      job->inverse[0][2] = job->inverse[1][2] = 1e30f;
+    }
+    else {
+      job->inverse[0][0] = d / det;
+      job->inverse[0][1] = -b / det;
+      job->inverse[0][2] = (b * ty - d * tx) / det;
+      job->inverse[1][0] = -c / det;
+      job->inverse[1][1] = a / det;
+      job->inverse[1][2] = (c * tx - a * ty) / det;
+    }
+  }
+  
+  // The calling thread renders the first band, and any band that did not
+  // get a thread of its own
+  int started = 1;
+  while (started < threads && startThread(&handles[started], renderBand, &jobs[started])) {
+    started++;
+  }
+  for (int i = started; i < threads; i++) {
+    renderBand(&jobs[i]);
+  }
+  renderBand(&jobs[0]);
+  for (int i = 1; i < started; i++) {
+    joinThread(handles[i]);
+  }
+  
+  free(handles);
+  free(jobs);
+}
+
+
+// Renders the rows of one RenderJob
+void renderBand(void *arg) {
+  const RenderJob *job = arg;
+  TRACE_BEGIN("renderBand");
+  
+  for (int row = job->firstRow; row < job->lastRow; row++) {
+    // Output rows go top to bottom, clip space y goes up
+    float y = 1 - (row + 0.5f) * 2 / job->height;
+    Pixel *out = job->out + (size_t) row * job->width;
+    
+    for (int col = 0; col < job->width; col++) {
+      float x = (col + 0.5f) * 2 / job->width - 1;
+      float mx = job->inverse[0][0] * x + job->inverse[0][1] * y + job->inverse[0][2];
+      float my = job->inverse[1][0] * x + job->inverse[1][1] * y + job->inverse[1][2];
+      
+      // Texture coordinates as given in vertexes
+      float u = (mx + 1) / 2;
+      float v = (1 - my) / 2;
+      
+      if (u < 0 || u > 1 || v < 0 || v > 1) {
+        // glClear leaves the background black
+        out[col].red = out[col].green = out[col].blue = 0;
+        continue;
+      }
+      if (job->bilinear) {
+        sampleBilinear(&out[col], job, u * job->imageWidth, v * job->imageHeight);
+      }
+      else {
+        sampleNearest(&out[col], job, u * job->imageWidth, v * job->imageHeight);
+      }
+      
+      // The filtered sample is adjusted, as in the fragment shader
+      Pixel *p = &out[col];
+      if (job->channel != 0) {
+        unsigned char gray = job->channel == 1 ? p->red : job->channel == 2 ? p->green : p->blue;
+        p->red = p->green = p->blue = gray;
+      }
+      p->red = job->colors[p->red];
+      p->green = job->colors[p->green];
+      p->blue = job->colors[p->blue];
+    }
+  }
+  TRACE_END("renderBand");
+}
+
+
+// Fills colors with what the tone adjustments, which are the same for every
+// channel, make of each 8-bit sample
+void colorTable(unsigned char *colors, const ColorAdjust *color) {
+  for (int i = 0; i < 256; i++) {
+    float c = (i / 255.0f - color->black) / (color->white - color->black);
+    c = c < 0 ? 0 : (c > 1 ? 1 : c);
+    c = color->gamma != 1 ? powf(c, 1 / color->gamma) : c;
+    c = (c - 0.5f) * color->contrast + 0.5f + color->brightness;
+    c = color->invert ? 1 - c : c;
+    c = c < 0 ? 0 : (c > 1 ? 1 : c);
+    colors[i] = (unsigned char) (c * 255 + 0.5f);
+  }
+}
+
+
+// Counts the samples of an image and derives its statistics from the
+// counts. The pixels are split into runs across threads, each counted into
+// bins of its own that are added up at the end.
+void computeHistogram(Histogram *hist, const unsigned char *pixels, Header h, int threads) {
+  size_t count = (size_t) h.width * h.height;
+  
+  // Small images are not worth a thread per processor
+  size_t most = count / 65536 + 1;
+  threads = (size_t) threads < most ? threads : (int) most;
+  threads = threads > 0 ? threads : 1;
+  
+  HistogramJob *jobs = malloc(sizeof(HistogramJob) * threads);
+  Thread *handles = malloc(sizeof(Thread) * threads);
+  if (jobs == NULL || handles == NULL) {
+    fprintf(stderr, "Error: Unable to allocate histogram threads.");
+    exit(1);
+  }
+  for (int i = 0; i < threads; i++) {
+    size_t first = count * i / threads, last = count * (i + 1) / threads;
+    jobs[i].samples = pixels + first * h.channels;
+    jobs[i].count = last - first;
+    jobs[i].channels = h.channels;
+  }
+  
+  int started = 1;
+  while (started < threads && startThread(&handles[started], countSamples, &jobs[started])) {
+    started++;
+  }
+  for (int i = started; i < threads; i++) {
+    countSamples(&jobs[i]);
+  }
+  countSamples(&jobs[0]);
+  for (int i = 1; i < started; i++) {
+    joinThread(handles[i]);
+  }
+  
+  memset(hist, 0, sizeof(Histogram));
+  hist->channels = h.channels;
+  for (int i = 0; i < threads; i++) {
+    for (unsigned int c = 0; c < h.channels; c++) {
+      for (int v = 0; v < 256; v++) {
+        hist->bins[c][v] += jobs[i].bins[c][v];
+      }
+    }
+  }
+  
+  // Minimum, maximum and mean need no pass over the pixels of their own
+  for (unsigned int c = 0; c < h.channels; c++) {
+    unsigned long long sum = 0;
+    hist->min[c] = 255;
+    for (int v = 0; v < 256; v++) {
+      if (hist->bins[c][v] != 0) {
+        hist->min[c] = v < (int) hist->min[c] ? (unsigned int) v : hist->min[c];
+        hist->max[c] = (unsigned int) v;
+      }
+      sum += hist->bins[c][v] * v;
+    }
+    hist->mean[c] = count > 0 ? (double) sum / count : 0;
+  }
+  
+  free(handles);
+  free(jobs);
+}
+
+
+// Counts the samples of one HistogramJob. Consecutive pixels go to four
+// copies of the bins in turn, so increments of the same value in a row, as
+// in flat areas, do not wait on each other. The 32-bit copies are added to
+// the job every HISTOGRAM_BLOCK pixels, before they can overflow.
+void countSamples(void *arg) {
+  HistogramJob *job = arg;
+  const unsigned char *p = job->samples;
+  unsigned int channels = job->channels;
+  size_t left = job->count;
+  unsigned int (*copies)[3][256] = calloc(4, sizeof(*copies));
+  if (copies == NULL) {
+    fprintf(stderr, "Error: Unable to allocate histogram bins.");
+    exit(1);
+  }
+  TRACE_BEGIN("countSamples");
+  
+  memset(job->bins, 0, sizeof(job->bins));
+  while (left > 0) {
+    size_t block = left < HISTOGRAM_BLOCK ? left : HISTOGRAM_BLOCK;
+    size_t quads = block / 4;
+    left -= block;
+    
+    if (channels == 3) {
+      for (size_t i = 0; i < quads; i++, p += 12) {
+        copies[0][0][p[0]]++;
+        copies[0][1][p[1]]++;
+        copies[0][2][p[2]]++;
+        copies[1][0][p[3]]++;
+        copies[1][1][p[4]]++;
+        copies[1][2][p[5]]++;
+        copies[2][0][p[6]]++;
+        copies[2][1][p[7]]++;
+        copies[2][2][p[8]]++;
+        copies[3][0][p[9]]++;
+        copies[3][1][p[10]]++;
+        copies[3][2][p[11]]++;
+      }
+    }
+    else {
+      for (size_t i = 0; i < quads; i++, p += 4) {
+        copies[0][0][p[0]]++;
+        copies[1][0][p[1]]++;
+        copies[2][0][p[2]]++;
+        copies[3][0][p[3]]++;
+      }
+    }
+    for (size_t i = quads * 4; i < block; i++, p += channels) {
+      for (unsigned int c = 0; c < channels; c++) {
+        copies[0][c][p[c]]++;
+      }
+    }
+    
+    for (int k = 0; k < 4; k++) {
+      for (unsigned int c = 0; c < channels; c++) {
+        for (int v = 0; v < 256; v++) {
+          job->bins[c][v] += copies[k][c][v];
+        }
+      }
+    }
+    memset(copies, 0, 4 * sizeof(*copies));
+  }
+  
+  TRACE_END("countSamples");
+  free(copies);
+}
+
+
+// Counts the samples of an image one at a time on the calling thread, for
+// --bench to compare computeHistogram with
+void naiveHistogram(Histogram *hist, const unsigned char *pixels, Header h) {
+  size_t count = (size_t) h.width * h.height;
+  unsigned long long sums[3] = {0, 0, 0};
+  
+  memset(hist, 0, sizeof(Histogram));
+  hist->channels = h.channels;
+  for (unsigned int c = 0; c < h.channels; c++) {
+    hist->min[c] = 255;
+  }
+  for (size_t i = 0; i < count; i++) {
+    for (unsigned int c = 0; c < h.channels; c++) {
+      unsigned int v = pixels[i * h.channels + c];
+      hist->bins[c][v]++;
+      hist->min[c] = v < hist->min[c] ? v : hist->min[c];
+      hist->max[c] = v > hist->max[c] ? v : hist->max[c];
+      sums[c] += v;
+    }
+  }
+  for (unsigned int c = 0; c < h.channels; c++) {
+    hist->mean[c] = count > 0 ? (double) sums[c] / count : 0;
+  }
+}
+
+
+// Draws a histogram as HISTOGRAM_PLOT_WIDTH by HISTOGRAM_PLOT_HEIGHT RGB
+// pixels, a column per value with each channel in its own color. Bars are
+// scaled to the tallest one other than 0 and 255, which clipped images pile
+// up in, and taller ones are cut off.
+unsigned char *plotHistogram(const Histogram *hist) {
+  unsigned char *plot = malloc(HISTOGRAM_PLOT_WIDTH * HISTOGRAM_PLOT_HEIGHT * 3);
+  unsigned long long tallest = 1;
+  if (plot == NULL) {
+    fprintf(stderr, "Error: Unable to allocate the histogram plot.");
+    exit(1);
+  }
+  
+  for (unsigned int c = 0; c < hist->channels; c++) {
+    for (int v = 1; v < 255; v++) {
+      tallest = hist->bins[c][v] > tallest ? hist->bins[c][v] : tallest;
+    }
+  }
+  memset(plot, 24, HISTOGRAM_PLOT_WIDTH * HISTOGRAM_PLOT_HEIGHT * 3);
+  for (unsigned int c = 0; c < hist->channels; c++) {
+    for (int x = 0; x < HISTOGRAM_PLOT_WIDTH; x++) {
+      unsigned long long bar = hist->bins[c][x] * HISTOGRAM_PLOT_HEIGHT / tallest;
+      bar = bar < HISTOGRAM_PLOT_HEIGHT ? bar : HISTOGRAM_PLOT_HEIGHT;
+      
+      // Rows go top to bottom, bars grow up
+      for (int y = HISTOGRAM_PLOT_HEIGHT - (int) bar; y < HISTOGRAM_PLOT_HEIGHT; y++) {
+        unsigned char *p = plot + (y * HISTOGRAM_PLOT_WIDTH + x) * 3;
+        if (hist->channels == 1) {
+          p[0] = p[1] = p[2] = 220;
+        }
+        else {
+          p[c] = 220;
+        }
+      }
+    }
+  }
+  return plot;
+}
+
+
+// Prints the statistics of a histogram on one line
+void writeHistogram(FILE *fh, const char *path, const Histogram *hist) {
+  static const char *names[] = {"red", "green", "blue"};
+  
+  fprintf(fh, "%s:", path);
+  for (unsigned int c = 0; c < hist->channels; c++) {
+    fprintf(fh, "%s %s min %u max %u mean %.2f", c > 0 ? "," : "",
+            hist->channels == 1 ? "gray" : names[c], hist->min[c], hist->max[c], hist->mean[c]);
+  }
+  fprintf(fh, "\n");
+  fflush(fh);
+}
+
+
+// Builds the MVP that puts the unit quad of the histogram plot at its size
+// in pixels in the bottom left corner of a framebuffer of the given size
+void overlayMatrix(mat4x4 mvp, int width, int height) {
+  float sx = (float) HISTOGRAM_PLOT_WIDTH / width;
+  float sy = (float) HISTOGRAM_PLOT_HEIGHT / height;
+  
+  mat4x4_identity(mvp);
+  mvp[0][0] = sx;
+  mvp[1][1] = sy;
+  mvp[3][0] = -1 + 2.0f * HISTOGRAM_MARGIN / width + sx;
+  mvp[3][1] = -1 + 2.0f * HISTOGRAM_MARGIN / height + sy;
+}
+
+
+// Sets the uniforms of the fragment shader for a ColorAdjust, in the
+// program in use
+void colorUniforms(Program *p, const ColorAdjust *color) {
+  glUniform4f(p->levels, color->black, 1 / (color->white - color->black), color->contrast,
+              color->brightness);
+  glUniform2f(p->tone, 1 / color->gamma, color->invert ? 1 : 0);
+  glUniform4f(p->channel, color->channel == 1, color->channel == 2, color->channel == 3,
+              color->channel != 0);
+}
+
+
+// Compiles the fragment shader for a filter, links it with the vertex
+// shader and finds its uniforms. Texture reads the first texture unit and
+// Weights the second.
+void linkProgram(Program *p, GLuint vertexShader, int filter) {
+  char define[32];
+  snprintf(define, sizeof(define), "#define FILTER %d\n", filter);
+  const char *sources[2] = {define, fragment_shader_text};
+  GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(fragmentShader, 2, sources, NULL);
+  glCompileShaderOrDie(fragmentShader);
+  
+  p->id = glCreateProgram();
+  glAttachShader(p->id, vertexShader);
+  glAttachShader(p->id, fragmentShader);
+  glBindAttribLocation(p->id, 0, "vPos");
+  glBindAttribLocation(p->id, 1, "TexCoordIn");
+  TRACE_BEGIN("glLinkProgram");
+  glLinkProgram(p->id);
+  TRACE_END("glLinkProgram");
+  // more error checking! glLinkProgramOrDie!
+  
+  p->mvp = glGetUniformLocation(p->id, "MVP");
+  p->levels = glGetUniformLocation(p->id, "Levels");
+  p->tone = glGetUniformLocation(p->id, "Tone");
+  p->channel = glGetUniformLocation(p->id, "Channel");
+  p->tileSize = glGetUniformLocation(p->id, "TileSize");
+  assert(p->mvp != -1 && p->levels != -1 && p->tone != -1 && p->channel != -1);
+  assert(filter == FILTER_NEAREST || p->tileSize != -1);
+  
+  glUseProgram(p->id);
+  glUniform1i(glGetUniformLocation(p->id, "Texture"), 0);
+  glUniform1i(glGetUniformLocation(p->id, "Weights"), 1);
+}
+
+
+// Creates the texture of filter weights the fragment shader looks up and
+// binds it to the active unit. Row 0 holds the Catmull-Rom weights of the
+// texels before, at and after the fragment as its fraction f across a texel
+// goes from 0 to 1, with the middle two added up and the point between
+// them that a GL_LINEAR fetch weighs in that ratio: w0, w1 + w2, w3 and
+// w2 / (w1 + w2). Rows 1 and 2 do the same for the six texels of Lanczos-3:
+// w0, w1, w2 + w3, w4, then w5 and w3 / (w2 + w3).
+GLuint weightTexture(void) {
+  unsigned char texels[WEIGHT_ROWS][WEIGHT_STEPS][4] = {{{0}}};
+  float rows[WEIGHT_ROWS][WEIGHT_STEPS][4] = {{{0}}};
+  GLuint texture;
+  
+  for (int i = 0; i < WEIGHT_STEPS; i++) {
+    double f = (double) i / (WEIGHT_STEPS - 1);
+    double cubic[4], lanczos[6], cubicSum = 0, lanczosSum = 0;
+    
+    // Taps are normalized, as a kernel cut off at its support does not
+    // quite add up to 1
+    for (int k = 0; k < 4; k++) {
+      cubic[k] = filterKernel(FILTER_BICUBIC, k - 1 - f);
+      cubicSum += cubic[k];
+    }
+    for (int k = 0; k < 6; k++) {
+      lanczos[k] = filterKernel(FILTER_LANCZOS, k - 2 - f);
+      lanczosSum += lanczos[k];
+    }
+    for (int k = 0; k < 4; k++) {
+      cubic[k] /= cubicSum;
+    }
+    for (int k = 0; k < 6; k++) {
+      lanczos[k] /= lanczosSum;
+    }
+    
+    float *r = rows[0][i];
+    r[0] = cubic[0];
+    r[1] = cubic[1] + cubic[2];
+    r[2] = cubic[3];
+    r[3] = cubic[2] / (cubic[1] + cubic[2]);
+    r = rows[1][i];
+    r[0] = lanczos[0];
+    r[1] = lanczos[1];
+    r[2] = lanczos[2] + lanczos[3];
+    r[3] = lanczos[4];
+    r = rows[2][i];
+    r[0] = lanczos[5];
+    r[1] = lanczos[3] / (lanczos[2] + lanczos[3]);
+  }
+  
+  for (int row = 0; row < WEIGHT_ROWS; row++) {
+    for (int i = 0; i < WEIGHT_STEPS; i++) {
+      for (int c = 0; c < 4; c++) {
+        float v = (rows[row][i][c] - WEIGHT_MIN) / WEIGHT_RANGE * 255 + 0.5f;
+        texels[row][i][c] = (unsigned char) (v < 0 ? 0 : (v > 255 ? 255 : v));
+      }
+    }
+  }
+  
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, WEIGHT_STEPS, WEIGHT_ROWS, 0, GL_RGBA,
+               GL_UNSIGNED_BYTE, texels);
+  return texture;
+}
+
+
+// Weight of a texel x texels away for FILTER_BICUBIC or FILTER_LANCZOS
+double filterKernel(int filter, double x) {
+  x = fabs(x);
+  if (filter == FILTER_BICUBIC) {
+    // Catmull-Rom, the cubic with a = -0.5
+    if (x < 1) {
+      return 1.5 * x * x * x - 2.5 * x * x + 1;
+    }
+    return x < 2 ? -0.5 * x * x * x + 2.5 * x * x - 4 * x + 2 : 0;
+  }
+  if (x < 1e-6) {
+    return 1;
+  }
+  return x < 3 ? 3 * sin(PI * x) * sin(PI * x / 3) / (PI * PI * x * x) : 0;
+}
+
+
+// Samples the texel containing (x, y), in pixels, like GL_NEAREST
+void sampleNearest(Pixel *out, const RenderJob *job, float x, float y) {
+  unsigned int ix = (unsigned int) x, iy = (unsigned int) y;
+  ix = ix < job->imageWidth ? ix : job->imageWidth - 1;
+  iy = iy < job->imageHeight ? iy : job->imageHeight - 1;
+  
+  // Luminance is spread over all three, like GL_LUMINANCE
+  unsigned int channels = job->channels;
+  const unsigned char *p = job->pixels + ((size_t) iy * job->imageWidth + ix) * channels;
+  out->red = p[0];
+  out->green = p[channels == 3 ? 1 : 0];
+  out->blue = p[channels == 3 ? 2 : 0];
+}
+
+
+// Blends the four texels around (x, y), in pixels, like GL_LINEAR with
+// clamping at the edges
+void sampleBilinear(Pixel *out, const RenderJob *job, float x, float y) {
+  x -= 0.5f;
+  y -= 0.5f;
+  float fx = floorf(x), fy = floorf(y);
+  float wx = x - fx, wy = y - fy;
+  int x0 = (int) fx, y0 = (int) fy;
+  int x1 = x0 + 1, y1 = y0 + 1;
+  int maxX = job->imageWidth - 1, maxY = job->imageHeight - 1;
+  
+  x0 = x0 < 0 ? 0 : (x0 > maxX ? maxX : x0);
+  x1 = x1 < 0 ? 0 : (x1 > maxX ? maxX : x1);
+  y0 = y0 < 0 ? 0 : (y0 > maxY ? maxY : y0);
+  y1 = y1 < 0 ? 0 : (y1 > maxY ? maxY : y1);
+  
+  unsigned int channels = job->channels;
+  size_t stride = (size_t) job->imageWidth * channels;
+  const unsigned char *p00 = job->pixels + y0 * stride + x0 * channels;
+  const unsigned char *p01 = job->pixels + y0 * stride + x1 * channels;
+  const unsigned char *p10 = job->pixels + y1 * stride + x0 * channels;
+  const unsigned char *p11 = job->pixels + y1 * stride + x1 * channels;
+  unsigned char result[3];
+  
+  for (unsigned int c = 0; c < channels; c++) {
+    float top = p00[c] + (p01[c] - p00[c]) * wx;
+    float bottom = p10[c] + (p11[c] - p10[c]) * wx;
+    result[c] = (unsigned char) (top + (bottom - top) * wy + 0.5f);
+  }
+  out->red = result[0];
+  out->green = result[channels == 3 ? 1 : 0];
+  out->blue = result[channels == 3 ? 2 : 0];
+}
+
+
+// Writes pixels as a P6 file
+void writeP6(FILE *fh, const Pixel *pixels, int width, int height) {
+  fprintf(fh, "P6\n%d %d\n255\n", width, height);
+  fwrite(pixels, sizeof(Pixel), (size_t) width * height, fh);
+}
+
+
+// Reads back the frame drawn by the GL, writes it to path as a P6 file and
+// compares it with renderSoftware's nearest sampled render of the same
+// view. Prints how many pixels differ by more than tolerance in a channel.
+// Returns 0 if more than CAPTURE_MAX_OUTLIERS of them do, or the file
+// cannot be written.
+int checkCapture(const char *path, int width, int height, const unsigned char *pixels,
+                 Header h, mat4x4 mvp, int threads, int tolerance) {
+  size_t count = (size_t) width * height;
+  unsigned char *rgba = malloc(count * 4);
+  Pixel *captured = malloc(sizeof(Pixel) * count);
+  Pixel *expected = malloc(sizeof(Pixel) * count);
+  FILE *output = fopen(path, "wb");
+  
+  if (rgba == NULL || captured == NULL || expected == NULL || output == NULL) {
+    fprintf(stderr, "Error: Unable to create output file.\n");
+    if (output != NULL) {
+      fclose(output);
+    }
+    free(rgba);
+    free(captured);
+    free(expected);
+    return 0;
+  }
+  
+  // GL rows go bottom up
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+  for (int y = 0; y < height; y++) {
+    const unsigned char *in = rgba + (size_t) (height - 1 - y) * width * 4;
+    Pixel *out = captured + (size_t) y * width;
+    for (int x = 0; x < width; x++, in += 4) {
+      out[x].red = in[0];
+      out[x].green = in[1];
+      out[x].blue = in[2];
+    }
+  }
+  renderSoftware(expected, width, height, pixels, h, mvp, 0, threads, &color_adjust);
+  
+  unsigned long outliers = 0;
+  int largest = 0;
+  for (size_t i = 0; i < count; i++) {
+    int red = abs(captured[i].red - expected[i].red);
+    int green = abs(captured[i].green - expected[i].green);
+    int blue = abs(captured[i].blue - expected[i].blue);
+    int most = red > green ? red : green;
+    most = blue > most ? blue : most;
+    largest = most > largest ? most : largest;
+    outliers += most > tolerance;
+  }
+  
+  writeP6(output, captured, width, height);
+  int written = fclose(output) == 0;
+  if (!written) {
+    fprintf(stderr, "Error: Unable to write output file.\n");
+  }
+  printf("%lu of %lu pixels differ from the CPU render by more than %d in a channel, "
+         "at most by %d\n", outliers, (unsigned long) count, tolerance, largest);
+  
+  free(rgba);
+  free(captured);
+  free(expected);
+  return written && outliers <= count * CAPTURE_MAX_OUTLIERS;
+}
+
+
+// Carries a ThreadFunc through the platform's thread entry point
+typedef struct ThreadStart {
+  ThreadFunc func;
+  void *arg;
+} ThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI threadEntry(LPVOID param) {
+#else
+static void *threadEntry(void *param) {
+#endif
+  ThreadStart start = *(ThreadStart *) param;
+  free(param);
+  start.func(start.arg);
+  return 0;
+}
+
+
+// Runs func(arg) on a new thread. Returns 0 on failure.
+int startThread(Thread *thread, ThreadFunc func, void *arg) {
+  ThreadStart *start = malloc(sizeof(ThreadStart));
+  if (start == NULL) {
+    return 0;
+  }
+  start->func = func;
+  start->arg = arg;
+#ifdef _WIN32
+  *thread = CreateThread(NULL, 0, threadEntry, start, 0, NULL);
+  if (*thread == NULL) {
+    free(start);
+    return 0;
+  }
+#else
+  if (pthread_create(thread, NULL, threadEntry, start) != 0) {
+    free(start);
+    return 0;
+  }
+#endif
+  return 1;
+}
+
+
+// Waits for a thread from startThread to finish
+void joinThread(Thread thread) {
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+
+void initMutex(Mutex *mutex) {
+#ifdef _WIN32
+  InitializeCriticalSection(mutex);
+#else
+  pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+
+void destroyMutex(Mutex *mutex) {
+#ifdef _WIN32
+  DeleteCriticalSection(mutex);
+#else
+  pthread_mutex_destroy(mutex);
+#endif
+}
+
+
+void lockMutex(Mutex *mutex) {
+#ifdef _WIN32
+  EnterCriticalSection(mutex);
+#else
+  pthread_mutex_lock(mutex);
+#endif
+}
+
+
+void unlockMutex(Mutex *mutex) {
+#ifdef _WIN32
+  LeaveCriticalSection(mutex);
+#else
+  pthread_mutex_unlock(mutex);
+#endif
+}
+
+
+void initCond(Cond *cond) {
+#ifdef _WIN32
+  InitializeConditionVariable(cond);
+#else
+  pthread_cond_init(cond, NULL);
+#endif
+}
+
+
+void waitCond(Cond *cond, Mutex *mutex) {
+#ifdef _WIN32
+  SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+  pthread_cond_wait(cond, mutex);
+#endif
+}
+
+
+void broadcastCond(Cond *cond) {
+#ifdef _WIN32
+  WakeAllConditionVariable(cond);
+#else
+  pthread_cond_broadcast(cond);
+#endif
+}
+
+
+// Sets a flag that another thread may be taking
+void raiseFlag(Flag *flag) {
+#ifdef _WIN32
+  InterlockedExchange(flag, 1);
+#else
+  atomic_store_explicit(flag, 1, memory_order_release);
+#endif
+}
+
+
+// Clears a flag and returns whether it was set
+int takeFlag(Flag *flag) {
+#ifdef _WIN32
+  return InterlockedExchange(flag, 0) != 0;
+#else
+  return atomic_exchange_explicit(flag, 0, memory_order_acq_rel) != 0;
+#endif
+}
+
+
+// Returns the number of processors available to run threads on
+int cpuCount(void) {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int) count : 1;
+#endif
 }
 
 
-// Skips lines that begin with '#'
-void skipComments(FILE *fh) {
-  char c = fgetc(fh);
+// Skips lines that begin with '#'. Returns 0 if a comment runs to the end
+// of the file.
+int skipComments(FILE *fh) {
+  int c = fgetc(fh);
   // Skip all comment lines
   while (c == '#') {
     // Go to the end of the line
@@ -486,8 +7016,8 @@ void skipComments(FILE *fh) {
       c = fgetc(fh);
       // Comments are potentially not closed
       if (c == EOF) {
-        fprintf(stderr, "Error: Reached EOF when parsing comment.");
-        exit(1);
+        fprintf(stderr, "Error: Reached EOF when parsing comment.\n");
+        return 0;
       }
     } while (c != '\n');
     
@@ -497,6 +7027,7 @@ void skipComments(FILE *fh) {
   
   // The standard library does not have a peek so we get and unget instead.
   ungetc(c, fh);
+  return 1;
 }
 
 //! [code]
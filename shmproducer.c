@@ -0,0 +1,255 @@
+// Reference producer for ezview --shm. Publishes frames into a POSIX
+// shared-memory ring laid out as in shmring.h, either from P5 and P6 files
+// or as a moving test pattern, at a fixed rate until interrupted.
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+// Default number of slots, so a frame can be read while the next two are
+// written
+#define DEFAULT_SLOTS 3
+
+// A frame loaded from a file
+typedef struct Frame {
+  unsigned int width, height, format;
+  unsigned char *pixels;
+} Frame;
+
+// Function declarations
+int loadFrame(Frame *, const char *);
+ShmSlot *beginFrame(ShmRing *);
+void endFrame(ShmRing *, ShmSlot *);
+void drawPattern(ShmSlot *, unsigned int, unsigned int, unsigned int, unsigned long long);
+double nowSeconds(void);
+void waitUntil(double);
+void stop(int);
+
+// Cleared by SIGINT and SIGTERM
+volatile sig_atomic_t running = 1;
+
+int main(int argc, char *argv[]) {
+  double fps = 30;
+  unsigned int slots = DEFAULT_SLOTS;
+  unsigned int width = 640, height = 480, format = SHM_FORMAT_RGB;
+  long long limit = -1;
+  const char *name = NULL;
+  Frame *frames = malloc(sizeof(Frame) * argc);
+  int frameCount = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+      fps = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--slots") == 0 && i + 1 < argc) {
+      slots = (unsigned int) atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%ux%u", &width, &height) != 2 || width == 0 || height == 0) {
+        fprintf(stderr, "Error: Size must be WIDTHxHEIGHT.\n");
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--gray") == 0) {
+      format = SHM_FORMAT_GRAY;
+    }
+    else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      limit = atoll(argv[++i]);
+    }
+    else if (strncmp(argv[i], "--", 2) == 0) {
+      fprintf(stderr, "Error: Unknown option %s.\n", argv[i]);
+      return 1;
+    }
+    else if (name == NULL) {
+      name = argv[i];
+    }
+    else if (!loadFrame(&frames[frameCount++], argv[i])) {
+      fprintf(stderr, "Error: Unable to read %s as an 8-bit P5 or P6 file.\n", argv[i]);
+      return 1;
+    }
+  }
+  if (fps <= 0 || slots == 0) {
+    fprintf(stderr, "Error: --fps and --slots must be positive.\n");
+    return 1;
+  }
+  if (name == NULL) {
+    fprintf(stderr, "Error: No shared memory name.\n");
+    printf("Usage: shmproducer [--fps FPS] [--frames N] [--gray] [--size WxH] [--slots N]\n"
+           "                   /name [input.ppm...]\n");
+    return 1;
+  }
+
+  // Slots are sized for the largest frame
+  unsigned long long capacity = frameCount > 0 ? 0 : (unsigned long long) width * height * format;
+  for (int i = 0; i < frameCount; i++) {
+    unsigned long long bytes = (unsigned long long) frames[i].width * frames[i].height *
+                               frames[i].format;
+    capacity = bytes > capacity ? bytes : capacity;
+  }
+
+  // A ring left by an earlier run is unlinked rather than resized, since a
+  // viewer may still have it mapped. The new object starts out zeroed.
+  size_t size = shmRingSize(slots, capacity);
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0 || ftruncate(fd, size) != 0) {
+    fprintf(stderr, "Error: Unable to create shared memory %s.\n", name);
+    if (fd >= 0) {
+      close(fd);
+      shm_unlink(name);
+    }
+    return 1;
+  }
+  ShmRing *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    fprintf(stderr, "Error: Unable to map shared memory %s.\n", name);
+    shm_unlink(name);
+    return 1;
+  }
+
+  // The magic number goes in last, once the rest describes the ring
+  ring->version = SHM_RING_VERSION;
+  ring->slotCount = slots;
+  ring->capacity = capacity;
+  atomic_store_explicit(&ring->published, 0, memory_order_relaxed);
+  atomic_store_explicit(&ring->magic, SHM_RING_MAGIC, memory_order_release);
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  double started = nowSeconds();
+  unsigned long long count = 0;
+  for (; running && (limit < 0 || (long long) count < limit); count++) {
+    ShmSlot *slot = beginFrame(ring);
+    if (frameCount > 0) {
+      Frame *f = &frames[count % frameCount];
+      slot->width = f->width;
+      slot->height = f->height;
+      slot->format = f->format;
+      memcpy(shmPixels(slot), f->pixels, (size_t) f->width * f->height * f->format);
+    }
+    else {
+      drawPattern(slot, width, height, format, count);
+    }
+    endFrame(ring, slot);
+    waitUntil(started + (count + 1) / fps);
+  }
+
+  double elapsed = nowSeconds() - started;
+  printf("Published %llu frames in %.2f s (%.2f fps)\n", count, elapsed,
+         elapsed > 0 ? count / elapsed : 0);
+  munmap(ring, size);
+  shm_unlink(name);
+  return 0;
+}
+
+
+// Reads an 8-bit P5 or P6 file. Returns 0 on failure.
+int loadFrame(Frame *f, const char *path) {
+  FILE *fh = fopen(path, "rb");
+  char magic[3] = {0};
+  unsigned int maxColor;
+  int ok = 0;
+
+  if (fh == NULL) {
+    return 0;
+  }
+
+  // Comments in the header are not supported
+  if (fscanf(fh, "%2s %u %u %u", magic, &f->width, &f->height, &maxColor) == 4 &&
+      (strcmp(magic, "P5") == 0 || strcmp(magic, "P6") == 0) && maxColor == 255 &&
+      f->width > 0 && f->height > 0) {
+    fgetc(fh);
+    f->format = magic[1] == '5' ? SHM_FORMAT_GRAY : SHM_FORMAT_RGB;
+    size_t bytes = (size_t) f->width * f->height * f->format;
+    f->pixels = malloc(bytes);
+    ok = f->pixels != NULL && fread(f->pixels, 1, bytes, fh) == bytes;
+  }
+  fclose(fh);
+  return ok;
+}
+
+
+// Claims the slot of the next frame. Its sequence is odd until endFrame.
+ShmSlot *beginFrame(ShmRing *ring) {
+  unsigned long long frame = atomic_load_explicit(&ring->published, memory_order_relaxed);
+  ShmSlot *slot = shmSlot(ring, frame);
+  unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+
+  atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+  // Nothing written to the slot may become visible before the odd count
+  atomic_thread_fence(memory_order_release);
+  slot->frame = frame;
+  return slot;
+}
+
+
+// Marks a slot from beginFrame as complete and makes it the newest frame
+void endFrame(ShmRing *ring, ShmSlot *slot) {
+  unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+
+  atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_release);
+  atomic_store_explicit(&ring->published, slot->frame + 1, memory_order_release);
+}
+
+
+// Fills a slot with gradients that scroll and a bar that sweeps across, so
+// dropped and torn frames are easy to spot
+void drawPattern(ShmSlot *slot, unsigned int width, unsigned int height, unsigned int format,
+                 unsigned long long frame) {
+  unsigned char *out = shmPixels(slot);
+  unsigned int bar = (unsigned int) (frame * 8 % width);
+
+  slot->width = width;
+  slot->height = height;
+  slot->format = format;
+  for (unsigned int y = 0; y < height; y++) {
+    for (unsigned int x = 0; x < width; x++) {
+      int lit = x >= bar && x < bar + 16;
+      unsigned char r = lit ? 255 : (unsigned char) (x + frame * 4);
+      unsigned char g = lit ? 255 : (unsigned char) (y + frame * 2);
+      unsigned char b = lit ? 255 : (unsigned char) (frame * 3);
+      if (format == SHM_FORMAT_GRAY) {
+        *out++ = (unsigned char) ((r * 77 + g * 150 + b * 29) >> 8);
+      }
+      else {
+        *out++ = r;
+        *out++ = g;
+        *out++ = b;
+      }
+    }
+  }
+}
+
+
+// Seconds on a monotonic clock
+double nowSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Sleeps until the monotonic clock reaches when
+void waitUntil(double when) {
+  double left = when - nowSeconds();
+  if (left > 0) {
+    struct timespec ts = {(time_t) left, (long) ((left - (time_t) left) * 1e9)};
+    nanosleep(&ts, NULL);
+  }
+}
+
+
+// Signal handler that ends the loop in main
+void stop(int sig) {
+  (void) sig;
+  running = 0;
+}
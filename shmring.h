@@ -0,0 +1,68 @@
+// Layout of the POSIX shared-memory ring that ezview --shm shows frames
+// from. A producer creates the object, sized with shmRingSize, and fills in
+// a ShmRing at its start. Slots follow, each a ShmSlot and then its pixels.
+//
+// Frames go into the slots in turn. Each slot has a sequence counter that
+// is odd while the producer writes it, so a reader can tell, without locks,
+// whether the frame it read changed under it.
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define SHM_RING_MAGIC 0x52565a45u         // "EZVR" in memory order
+#define SHM_RING_VERSION 1
+
+// Slot headers and pixel data start at multiples of this
+#define SHM_RING_ALIGN 64
+
+// Pixel formats, which are also the bytes per pixel
+#define SHM_FORMAT_GRAY 1
+#define SHM_FORMAT_RGB 3
+
+// Start of the shared-memory object
+typedef struct ShmRing {
+  atomic_uint magic;                       // Stored last, with release order
+  unsigned int version;
+  unsigned int slotCount;
+  unsigned int reserved;
+  unsigned long long capacity;             // Pixel bytes each slot can hold
+  atomic_ullong published;                 // Frames written so far. The newest
+                                           // is in slot (published - 1) % slotCount.
+} ShmRing;
+
+// Start of a slot. width * height * format bytes of packed rows follow at
+// SHM_SLOT_HEADER_SIZE.
+typedef struct ShmSlot {
+  atomic_uint sequence;                    // Odd while the slot is written
+  unsigned int width, height;
+  unsigned int format;
+  unsigned long long frame;                // Published count before this frame
+} ShmSlot;
+
+#define SHM_ALIGNED(bytes) (((bytes) + SHM_RING_ALIGN - 1) / SHM_RING_ALIGN * SHM_RING_ALIGN)
+#define SHM_RING_HEADER_SIZE SHM_ALIGNED(sizeof(ShmRing))
+#define SHM_SLOT_HEADER_SIZE SHM_ALIGNED(sizeof(ShmSlot))
+
+// Bytes from one slot to the next
+static inline size_t shmSlotSize(unsigned long long capacity) {
+  return SHM_SLOT_HEADER_SIZE + SHM_ALIGNED((size_t) capacity);
+}
+
+// Bytes of a whole ring
+static inline size_t shmRingSize(unsigned int slotCount, unsigned long long capacity) {
+  return SHM_RING_HEADER_SIZE + slotCount * shmSlotSize(capacity);
+}
+
+static inline ShmSlot *shmSlot(ShmRing *ring, unsigned long long index) {
+  return (ShmSlot *) ((unsigned char *) ring + SHM_RING_HEADER_SIZE +
+                      (index % ring->slotCount) * shmSlotSize(ring->capacity));
+}
+
+static inline unsigned char *shmPixels(ShmSlot *slot) {
+  return (unsigned char *) slot + SHM_SLOT_HEADER_SIZE;
+}
+
+#endif